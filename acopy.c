@@ -0,0 +1,987 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "acopy_internal.h"
+
+static const char *engine_names[] = {"posix-aio", "io_uring", "copy_file_range", "sendfile", "splice", "mmap", "auto"};
+static const char *completion_names[] = {"spin", "suspend", "signal", "thread"};
+static const char *durability_names[] = {"none", "end", "writebehind", "dsync"};
+static const char *codec_names[] = {"none", "lz4", "zstd"};
+
+const char *acopy_engine_name(enum acopy_engine engine)
+{
+    return engine_names[engine];
+}
+
+int acopy_engine_parse(const char *name, enum acopy_engine *engine)
+{
+    for (int e = ACOPY_ENGINE_POSIX_AIO; e <= ACOPY_ENGINE_AUTO; e++)
+    {
+        if (strcmp(name, engine_names[e]) == 0)
+        {
+            *engine = e;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *acopy_completion_name(enum acopy_completion completion)
+{
+    return completion_names[completion];
+}
+
+int acopy_completion_parse(const char *name, enum acopy_completion *completion)
+{
+    for (int m = ACOPY_COMPLETION_SPIN; m <= ACOPY_COMPLETION_THREAD; m++)
+    {
+        if (strcmp(name, completion_names[m]) == 0)
+        {
+            *completion = m;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *acopy_durability_name(enum acopy_durability durability)
+{
+    return durability_names[durability];
+}
+
+int acopy_durability_parse(const char *name, enum acopy_durability *durability)
+{
+    for (int d = ACOPY_DURABILITY_NONE; d <= ACOPY_DURABILITY_DSYNC; d++)
+    {
+        if (strcmp(name, durability_names[d]) == 0)
+        {
+            *durability = d;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *acopy_codec_name(enum acopy_codec codec)
+{
+    return codec_names[codec];
+}
+
+int acopy_codec_parse(const char *name, enum acopy_codec *codec)
+{
+    for (int c = ACOPY_CODEC_NONE; c <= ACOPY_CODEC_ZSTD; c++)
+    {
+        if (strcmp(name, codec_names[c]) == 0)
+        {
+            *codec = c;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Options and context.
+// -------------------------------------------------------------------------------------------------------
+void acopy_opts_init(struct acopy_opts *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->engine = ACOPY_ENGINE_POSIX_AIO;
+    opts->completion = ACOPY_COMPLETION_SPIN;
+    opts->block_size = 128 * 1024;
+    opts->num_async_ops = 12;
+    opts->threads = 1;
+    opts->memory_cap = 64 * 1024 * 1024;
+    opts->writebehind_bytes = 32 * 1024 * 1024;
+    opts->preallocate = 1;
+}
+
+int acopy_opts_check(const struct acopy_opts *opts)
+{
+    if (opts->block_size == 0)
+    {
+        fprintf(stderr, "The block size must not be zero\n");
+        return -1;
+    }
+    if (opts->num_async_ops < 1 || opts->num_async_ops > ACOPY_MAX_IO_OPERATIONS)
+    {
+        fprintf(stderr, "The number of asynchronous operations must be between 1 and %d\n", ACOPY_MAX_IO_OPERATIONS);
+        return -1;
+    }
+    if (opts->threads < 1 || opts->threads > ACOPY_MAX_THREADS)
+    {
+        fprintf(stderr, "The number of threads must be between 1 and %d\n", ACOPY_MAX_THREADS);
+        return -1;
+    }
+    if (opts->auto_tune && (opts->threads > 1 || (opts->engine != ACOPY_ENGINE_POSIX_AIO && opts->engine != ACOPY_ENGINE_IO_URING)))
+    {
+        fprintf(stderr, "Auto-tuning works with a single-threaded posix-aio or io_uring copy\n");
+        return -1;
+    }
+    if (opts->auto_tune && opts->memory_cap < 2 * opts->block_size * opts->num_async_ops)
+    {
+        fprintf(stderr, "The memory cap is smaller than the starting buffer pool\n");
+        return -1;
+    }
+    if (opts->sparse && (opts->threads > 1 || opts->auto_tune))
+    {
+        fprintf(stderr, "Sparse copies cannot be combined with several threads or auto-tuning\n");
+        return -1;
+    }
+    if (opts->verify != ACOPY_VERIFY_NONE &&
+        ((opts->engine != ACOPY_ENGINE_POSIX_AIO && opts->engine != ACOPY_ENGINE_IO_URING) || opts->sparse || opts->auto_tune))
+    {
+        // The zero-copy engines never bring the data into a buffer that could be hashed.
+        fprintf(stderr, "Verification works with the posix-aio or io_uring engine, without sparse copies or auto-tuning\n");
+        return -1;
+    }
+    if (opts->resume && (opts->threads > 1 || opts->sparse || opts->auto_tune || opts->verify != ACOPY_VERIFY_NONE ||
+                         (opts->engine != ACOPY_ENGINE_POSIX_AIO && opts->engine != ACOPY_ENGINE_IO_URING)))
+    {
+        fprintf(stderr, "Resuming works with a single-threaded posix-aio or io_uring copy, without sparse copies, auto-tuning or verification\n");
+        return -1;
+    }
+    if (opts->durability == ACOPY_DURABILITY_WRITEBEHIND && opts->writebehind_bytes <= 0)
+    {
+        fprintf(stderr, "The write-behind window must not be zero\n");
+        return -1;
+    }
+    if (opts->ordered_writes && (opts->engine == ACOPY_ENGINE_COPY_FILE_RANGE || opts->engine == ACOPY_ENGINE_SENDFILE || opts->engine == ACOPY_ENGINE_SPLICE ||
+                                 opts->engine == ACOPY_ENGINE_MMAP))
+    {
+        // Each zero-copy thread writes its range front to back already.
+        fprintf(stderr, "Ordered writes work with the posix-aio or io_uring engine\n");
+        return -1;
+    }
+    if (opts->engine == ACOPY_ENGINE_MMAP && opts->direct)
+    {
+        // A mapping is the page cache.
+        fprintf(stderr, "The mmap engine cannot be combined with direct I/O\n");
+        return -1;
+    }
+    if (opts->mmap_copy && opts->engine != ACOPY_ENGINE_MMAP)
+    {
+        fprintf(stderr, "Copying between mappings needs the mmap engine\n");
+        return -1;
+    }
+    if (opts->compress != ACOPY_CODEC_NONE && opts->decompress)
+    {
+        fprintf(stderr, "A copy either compresses or decompresses\n");
+        return -1;
+    }
+    if ((opts->compress != ACOPY_CODEC_NONE || opts->decompress) &&
+        (opts->engine != ACOPY_ENGINE_POSIX_AIO || opts->threads > 1 || opts->direct || opts->sparse || opts->auto_tune || opts->resume ||
+         opts->verify != ACOPY_VERIFY_NONE || opts->durability == ACOPY_DURABILITY_WRITEBEHIND))
+    {
+        // The codec sits between the reads and the writes of the posix-aio loop, and the two files no longer share offsets.
+        fprintf(stderr, "Compression works with a single-threaded posix-aio copy, without direct I/O, sparse copies, auto-tuning, resuming, "
+                        "verification or write-behind\n");
+        return -1;
+    }
+    if (opts->compress != ACOPY_CODEC_NONE && opts->block_size > 1024 * 1024 * 1024)
+    {
+        // The frame index holds 32-bit lengths.
+        fprintf(stderr, "The block size of a compressed copy must not be above 1 GB\n");
+        return -1;
+    }
+    if (opts->compress_threads < 0 || opts->compress_threads > ACOPY_MAX_THREADS)
+    {
+        fprintf(stderr, "The number of compression threads must be between 0 (one per core) and %d\n", ACOPY_MAX_THREADS);
+        return -1;
+    }
+    if (opts->aio_threads < 0 || opts->aio_threads > ACOPY_MAX_IO_OPERATIONS || opts->aio_idle_time < 0)
+    {
+        fprintf(stderr, "The number of AIO threads must be between 0 (sized to the operations in flight) and %d, and their idle time not negative\n", ACOPY_MAX_IO_OPERATIONS);
+        return -1;
+    }
+    if (opts->manifest && opts->verify == ACOPY_VERIFY_NONE)
+    {
+        fprintf(stderr, "A manifest needs verification to be turned on\n");
+        return -1;
+    }
+    if (opts->threads > 1 && opts->completion == ACOPY_COMPLETION_SIGNAL)
+    {
+        // The completion signal is process-wide, so it cannot be routed to one worker's signalfd.
+        fprintf(stderr, "The signal completion mode cannot be combined with several threads\n");
+        return -1;
+    }
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Buffer pool memory.
+// With huge pages a large pool takes a few TLB entries instead of one per 4 KB page. The pool comes from
+// MAP_HUGETLB while the reserved pool (vm.nr_hugepages) has room, and otherwise from an anonymous mapping
+// aligned to a huge page and marked MADV_HUGEPAGE, which the kernel backs with transparent huge pages
+// where it can. Without them, or when neither works, it is plain posix_memalign() memory.
+// -------------------------------------------------------------------------------------------------------
+
+// Size of the default huge page, 0 if the kernel has none.
+static size_t huge_page_size(void)
+{
+    char line[128];
+    size_t kb = 0;
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    if (!meminfo) return 0;
+    while (fgets(line, sizeof(line), meminfo))
+    {
+        if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1) break;
+    }
+    fclose(meminfo);
+    return kb * 1024;
+}
+
+// At least *size bytes; *size is set to what was allocated and *pages to where it came from.
+static char *pool_alloc(size_t *size, size_t alignment, int huge, enum acopy_pages *pages)
+{
+    size_t huge_size = huge ? huge_page_size() : 0;
+    char *buffer = NULL;
+    if (huge_size > 0 && huge_size % alignment == 0)
+    {
+        size_t length = (*size + huge_size - 1) / huge_size * huge_size;
+        buffer = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buffer != MAP_FAILED)
+        {
+            *size = length;
+            *pages = ACOPY_PAGES_HUGETLB;
+            return buffer;
+        }
+        // Map one huge page more than needed and trim it, so the pool starts on a huge page boundary.
+        char *area = mmap(NULL, length + huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (area != MAP_FAILED)
+        {
+            buffer = (char *)(((uintptr_t)area + huge_size - 1) & ~(uintptr_t)(huge_size - 1));
+            if (buffer > area) munmap(area, buffer - area);
+            if (area + huge_size > buffer) munmap(buffer + length, area + huge_size - buffer);
+            if (madvise(buffer, length, MADV_HUGEPAGE) == 0)
+            {
+                *size = length;
+                *pages = ACOPY_PAGES_THP;
+                return buffer;
+            }
+            munmap(buffer, length); // A kernel without THP.
+        }
+        buffer = NULL;
+    }
+    errno = posix_memalign((void **)&buffer, alignment, *size);
+    if (errno != 0)
+    {
+        perror("posix_memalign");
+        return NULL;
+    }
+    *pages = ACOPY_PAGES_NORMAL;
+    return buffer;
+}
+
+static void pool_free(char *buffer, size_t size, enum acopy_pages pages)
+{
+    if (!buffer) return;
+    if (pages == ACOPY_PAGES_NORMAL) free(buffer);
+    else munmap(buffer, size);
+}
+
+// Buffer of at least size bytes, reused from the previous copy when it is big and aligned enough and in the
+// kind of pages asked for.
+char *ctx_buffer(struct acopy_ctx *ctx, size_t size, size_t alignment, int huge)
+{
+    if (ctx->buffer && ctx->buffer_size >= size && ctx->buffer_alignment % alignment == 0 && ctx->buffer_huge == huge) return ctx->buffer;
+    if (ctx->buffer) pool_free(ctx->buffer, ctx->buffer_size, ctx->buffer_pages);
+    ctx->buffer = pool_alloc(&size, alignment, huge, &ctx->buffer_pages);
+    if (!ctx->buffer)
+    {
+        ctx->buffer_size = 0;
+        return NULL;
+    }
+    ctx->buffer_size = size;
+    ctx->buffer_alignment = alignment;
+    ctx->buffer_huge = huge;
+    return ctx->buffer;
+}
+
+struct acopy_ctx *acopy_ctx_new(void)
+{
+    struct acopy_ctx *ctx = calloc(1, sizeof(struct acopy_ctx));
+    if (!ctx) perror("calloc");
+    return ctx;
+}
+
+void acopy_ctx_free(struct acopy_ctx *ctx)
+{
+    if (!ctx) return;
+    pool_free(ctx->buffer, ctx->buffer_size, ctx->buffer_pages);
+    free(ctx);
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Block feeder over a range of one pair of files.
+// -------------------------------------------------------------------------------------------------------
+static int range_feeder_next(struct block_feeder *base, struct copy_block *block, int wait)
+{
+    struct range_feeder *feeder = (struct range_feeder *)base;
+    (void)wait;
+    if (feeder->offset >= feeder->range.end) return -1;
+    block->source_fd = feeder->source_fd;
+    block->destination_fd = feeder->destination_fd;
+    block->offset = feeder->offset;
+    block->length = (feeder->range.end - feeder->offset < (off_t)feeder->block_size) ? (size_t)(feeder->range.end - feeder->offset) : feeder->block_size;
+    block->owner = NULL;
+    feeder->offset += feeder->range.step;
+    prefetch_advance(&feeder->prefetch, block->offset);
+    writeback_advance(&feeder->writeback, block->offset);
+    return 1;
+}
+
+void range_feeder_init(struct range_feeder *feeder, int source_fd, int destination_fd, const struct block_range *range, size_t block_size)
+{
+    feeder->base.next = range_feeder_next;
+    feeder->base.done = NULL;
+    feeder->base.stats = NULL;
+    feeder->base.digests = NULL;
+    feeder->base.ordered = 0;
+    feeder->base.sequential = 0;
+    feeder->base.throttle = NULL;
+    feeder->base.codec = NULL;
+    feeder->source_fd = source_fd;
+    feeder->destination_fd = destination_fd;
+    feeder->range = *range;
+    feeder->offset = range->start;
+    feeder->block_size = block_size;
+    writeback_init(&feeder->writeback, source_fd, destination_fd, range->start, NULL);
+    prefetch_init(&feeder->prefetch, source_fd, range->start, NULL);
+}
+
+// Next block of the feeder, once the throttle lets another operation start.
+int feeder_next(struct block_feeder *feeder, struct copy_block *block, int wait)
+{
+    if (!throttle_ready(feeder->throttle, feeder->stats, wait)) return 0;
+    int got = feeder->next(feeder, block, wait);
+    if (got == 1) throttle_charge(feeder->throttle, block->length);
+    return got;
+}
+
+void feeder_done(struct block_feeder *feeder, struct copy_block *block, int status)
+{
+    if (feeder->done) feeder->done(feeder, block, status);
+}
+
+
+// -------------------------------------------------------------------------------------------------------
+// Run posix-aio or io_uring over one block range with the given buffer.
+// -------------------------------------------------------------------------------------------------------
+int copy_range(enum acopy_engine engine, int source_fd, int destination_fd, const struct block_range *range, char *buffer, const struct acopy_opts *opts,
+               struct digest_table *digests)
+{
+    struct range_feeder feeder;
+    range_feeder_init(&feeder, source_fd, destination_fd, range, opts->block_size);
+    feeder.base.stats = opts->stats;
+    feeder.base.digests = digests;
+    feeder.base.ordered = opts->ordered_writes;
+    feeder.base.sequential = (opts->hdd == ACOPY_HDD_ON);
+    feeder.base.throttle = opts->throttle;
+    writeback_init(&feeder.writeback, source_fd, destination_fd, range->start, opts);
+    prefetch_init(&feeder.prefetch, source_fd, range->start, opts);
+    if (engine == ACOPY_ENGINE_IO_URING) return uring_copy_loop(&feeder.base, buffer, opts->block_size, opts->num_async_ops);
+    return aio_copy_loop(&feeder.base, buffer, opts->block_size, opts->num_async_ops, opts->completion);
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Multi-threaded copy: the file is split into one contiguous range (or one set of interleaved stripes)
+// per worker. Every worker is pinned to a core and runs its own engine loop with its own in-flight
+// queue and buffer slab, so the workers share no locks while copying.
+// -------------------------------------------------------------------------------------------------------
+struct copy_worker
+{
+    pthread_t thread;
+    enum acopy_engine engine;
+    const struct acopy_opts *opts;
+    int source_fd, destination_fd;
+    struct block_range range;
+    struct digest_table *digests;  // Shared by all workers; each block has its own entry.
+    size_t alignment;              // Alignment of the buffer slab.
+    int status;
+    struct acopy_worker_report *report;
+};
+
+static void *copy_worker_main(void *arg)
+{
+    struct copy_worker *worker = arg;
+    struct timespec start, finish;
+    char *buffer = NULL;
+    size_t buffer_size = 2 * worker->opts->block_size * worker->opts->num_async_ops;
+    enum acopy_pages pages;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(worker->report->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) worker->report->cpu = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // The slab is allocated after pinning, so its pages are first touched on the worker's own node.
+    buffer = pool_alloc(&buffer_size, worker->alignment, worker->opts->huge_pages, &pages);
+    if (!buffer)
+    {
+        worker->status = -1;
+        return NULL;
+    }
+    worker->status = copy_range(worker->engine, worker->source_fd, worker->destination_fd, &worker->range, buffer, worker->opts, worker->digests);
+    pool_free(buffer, buffer_size, pages);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    worker->report->elapsed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    return NULL;
+}
+
+static int copy_parallel(enum acopy_engine engine, int source_fd, int destination_fd, off_t total_size, size_t alignment, const struct acopy_opts *opts,
+                         struct digest_table *digests, struct acopy_report *report)
+{
+    struct copy_worker workers[ACOPY_MAX_THREADS];
+    off_t block_size = opts->block_size;
+    off_t blocks = (total_size + block_size - 1) / block_size;
+    off_t blocks_per_worker = (blocks + opts->threads - 1) / opts->threads;
+    int cpus[CPU_SETSIZE];
+    int num_cpus = 0;
+    int started = 0;
+    int status = 0;
+    cpu_set_t allowed;
+
+    // Pin the workers round-robin over the cores this process may run on.
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed)) cpus[num_cpus++] = cpu;
+        }
+    }
+    if (num_cpus == 0) cpus[num_cpus++] = 0;
+
+    report->num_workers = opts->threads;
+    for (int i = 0; i < opts->threads; i++)
+    {
+        struct copy_worker *worker = &workers[i];
+        memset(worker, 0, sizeof(*worker));
+        worker->engine = engine;
+        worker->opts = opts;
+        worker->source_fd = source_fd;
+        worker->destination_fd = destination_fd;
+        worker->alignment = alignment;
+        worker->digests = digests;
+        worker->report = &report->workers[i];
+        if (opts->stripes)
+        {
+            worker->range.start = i * block_size;
+            worker->range.end = total_size;
+            worker->range.step = opts->threads * block_size;
+        }
+        else
+        {
+            worker->range.start = i * blocks_per_worker * block_size;
+            worker->range.end = worker->range.start + blocks_per_worker * block_size;
+            if (worker->range.end > total_size) worker->range.end = total_size;
+            worker->range.step = block_size;
+        }
+        memset(worker->report, 0, sizeof(*worker->report));
+        worker->report->cpu = cpus[i % num_cpus];
+        for (off_t offset = worker->range.start; offset < worker->range.end; offset += worker->range.step)
+        {
+            worker->report->bytes += (worker->range.end - offset < block_size) ? worker->range.end - offset : block_size;
+        }
+    }
+    for (int i = 0; i < opts->threads; i++)
+    {
+        errno = pthread_create(&workers[i].thread, NULL, copy_worker_main, &workers[i]);
+        if (errno != 0)
+        {
+            perror("pthread_create");
+            status = -1;
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].status == -1) status = -1;
+    }
+    return status;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Direct I/O alignment required by an open file, 0 if the file does not support O_DIRECT.
+// -------------------------------------------------------------------------------------------------------
+static size_t direct_alignment(int fd)
+{
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == -1 || !(stx.stx_mask & STATX_DIOALIGN))
+    {
+        // Kernels before 6.1 do not report it; a page is a safe logical block size everywhere.
+        return sysconf(_SC_PAGESIZE);
+    }
+    if (stx.stx_dio_offset_align == 0) return 0;
+    return (stx.stx_dio_offset_align > stx.stx_dio_mem_align) ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Copy [offset, total_size) with plain pread/pwrite after turning O_DIRECT off, for the unaligned tail.
+// -------------------------------------------------------------------------------------------------------
+static int copy_tail_buffered(int source_fd, int destination_fd, off_t offset, off_t total_size, char *buffer, size_t block_size,
+                              struct digest_table *digests)
+{
+    if (fcntl(source_fd, F_SETFL, fcntl(source_fd, F_GETFL) & ~O_DIRECT) == -1 ||
+        fcntl(destination_fd, F_SETFL, fcntl(destination_fd, F_GETFL) & ~O_DIRECT) == -1)
+    {
+        perror("fcntl O_DIRECT");
+        return -1;
+    }
+    while (offset < total_size)
+    {
+        size_t size = (total_size - offset < (off_t)block_size) ? (size_t)(total_size - offset) : block_size;
+        ssize_t bytes_read = pread(source_fd, buffer, size, offset);
+        if (bytes_read == -1)
+        {
+            if (errno == EINTR) continue;
+            perror("pread");
+            return -1;
+        }
+        if (bytes_read == 0) break; // The source shrank.
+        if (digests)
+        {
+            struct digest_entry *entry = digest_table_entry(digests, offset);
+            entry->offset = offset;
+            entry->length = bytes_read;
+            entry->crc = crc32c(0, buffer, bytes_read);
+        }
+        for (ssize_t written = 0; written < bytes_read;)
+        {
+            ssize_t ret = pwrite(destination_fd, buffer + written, bytes_read - written, offset + written);
+            if (ret == -1)
+            {
+                if (errno == EINTR) continue;
+                perror("pwrite");
+                return -1;
+            }
+            written += ret;
+        }
+        offset += bytes_read;
+    }
+    return 0;
+}
+
+double timespec_diff(const struct timespec *start, const struct timespec *finish)
+{
+    return (finish->tv_sec - start->tv_sec) + (finish->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+double timeval_diff(const struct timeval *start, const struct timeval *finish)
+{
+    return (finish->tv_sec - start->tv_sec) + (finish->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Copy one file with the selected engine and fill in the report.
+// -------------------------------------------------------------------------------------------------------
+int acopy_file(struct acopy_ctx *ctx, const char *source_path, const char *destination_path, const struct acopy_opts *opts, struct acopy_report *report)
+{
+    int source_fd, destination_fd;
+    struct stat source_stat; // for getting file size
+    struct stat destination_stat;
+    struct acopy_opts resolved; // opts with HDD mode settled
+    off_t total_size; // total size of the source file
+    off_t engine_size; // part of the file copied by the engine
+    size_t alignment = sizeof(void *);
+    struct timespec start, finish;
+    struct rusage usage_start, usage_finish;
+    int open_flags = opts->direct ? O_DIRECT : 0;
+    struct extent_list extents = {NULL, 0, 0};
+    struct digest_table digests = {NULL, 0, 0};
+    struct digest_table *digesting = NULL;
+    struct copy_journal journal;
+    struct block_codec codec;
+    int coded = (opts->compress != ACOPY_CODEC_NONE || opts->decompress);
+    off_t destination_size; // size the destination ends up with
+    int status = 0;
+
+    memset(report, 0, sizeof(*report));
+    memset(&codec, 0, sizeof(codec));
+
+    // Open the source file for reading and the destination file for writing (creating it if it doesn't exist)
+    // -------------------------------------------------------------------------------------------------------
+    source_fd = open(source_path, O_RDONLY | open_flags);
+    if (source_fd == -1) 
+    {
+        perror("open source");
+        return -1;
+    }
+    // Get the size of the source file
+    if (fstat(source_fd, &source_stat) == -1) 
+    {
+        perror("fstat");
+        close(source_fd);
+        return -1;
+    }
+    total_size = source_stat.st_size;
+    engine_size = total_size;
+    destination_size = total_size;
+    // A resumed copy reads the destination back to check the blocks the journal lists, and a mapping of the
+    // destination needs it readable as well.
+    destination_fd = open(destination_path, ((opts->resume || opts->mmap_copy) ? O_RDWR : O_WRONLY) | O_CREAT | open_flags |
+                          (opts->durability == ACOPY_DURABILITY_DSYNC ? O_DSYNC : 0), 0644);
+    if (destination_fd == -1) 
+    {
+        perror("open destination");
+        close(source_fd);
+        return -1;
+    }
+    if (fstat(destination_fd, &destination_stat) == -1)
+    {
+        perror("fstat");
+        close(source_fd);
+        close(destination_fd);
+        return -1;
+    }
+    if (destination_stat.st_dev == source_stat.st_dev && destination_stat.st_ino == source_stat.st_ino)
+    {
+        // The destination is cut to nothing before the copy starts.
+        fprintf(stderr, "%s and %s are the same file\n", source_path, destination_path);
+        close(source_fd);
+        close(destination_fd);
+        return -1;
+    }
+
+    if (opts->direct)
+    {
+        // O_DIRECT needs offsets, lengths and buffers aligned to the logical block size of both files.
+        size_t source_alignment = direct_alignment(source_fd);
+        size_t destination_alignment = direct_alignment(destination_fd);
+        if (source_alignment == 0 || destination_alignment == 0)
+        {
+            fprintf(stderr, "Direct I/O is not supported on this filesystem\n");
+            close(source_fd);
+            close(destination_fd);
+            return -1;
+        }
+        alignment = (source_alignment > destination_alignment) ? source_alignment : destination_alignment;
+        if (opts->block_size % alignment != 0)
+        {
+            fprintf(stderr, "The block size must be a multiple of %zu bytes for direct I/O\n", alignment);
+            close(source_fd);
+            close(destination_fd);
+            return -1;
+        }
+        // The engine copies whole logical blocks; the unaligned tail goes through the page cache.
+        engine_size = total_size - (total_size % alignment);
+        if (alignment < (size_t)sysconf(_SC_PAGESIZE)) alignment = sysconf(_SC_PAGESIZE);
+    }
+
+    report->hdd = hdd_mode(opts, source_stat.st_dev, destination_stat.st_dev);
+    hdd_opts(&resolved, opts, report->hdd);
+    opts = &resolved;
+    // The source is read front to back; with a spinning disk this also lets the kernel read further ahead.
+    if (!opts->direct) posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // Auto mode ends up on posix-aio when nothing else works.
+    if (opts->engine == ACOPY_ENGINE_POSIX_AIO || opts->engine == ACOPY_ENGINE_AUTO) aio_configure(opts);
+    // A decompressing copy takes its block size from the frame index, so this comes before the buffers.
+    if (coded && codec_open(&codec, source_fd, total_size, &resolved, &destination_size) == -1)
+    {
+        close(source_fd);
+        close(destination_fd);
+        return -1;
+    }
+
+    // Allocate a buffer to hold the data for asynchronous operations.
+    // Two blocks per operation, so reads can run ahead of the writes.
+    // -------------------------------------------------------------------------------------------------------
+    char *buffer = ctx_buffer(ctx, 2 * opts->block_size * opts->num_async_ops, alignment, opts->huge_pages);
+    if (!buffer)
+    {
+        close(source_fd);
+        close(destination_fd);
+        codec_close(&codec);
+        return -1;
+    }
+    report->buffer_pages = ctx->buffer_pages;
+    report->buffer_bytes = ctx->buffer_size;
+    if (opts->verify != ACOPY_VERIFY_NONE)
+    {
+        if (digest_table_init(&digests, engine_size, opts->block_size) == -1)
+        {
+            close(source_fd);
+            close(destination_fd);
+            return -1;
+        }
+        digesting = &digests;
+    }
+
+    getrusage(RUSAGE_SELF, &usage_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // A sparse copy lays out its own destination, once it knows where the data is. A compressed one does
+    // not know its size before the end, and only cuts the destination to nothing.
+    if (!opts->sparse && prepare_destination(destination_fd, destination_size, opts) == -1)
+    {
+        close(source_fd);
+        close(destination_fd);
+        digest_table_free(&digests);
+        codec_close(&codec);
+        return -1;
+    }
+    if (opts->resume)
+    {
+        if (journal_open(&journal, destination_path, source_fd, destination_fd, &source_stat, engine_size, opts->block_size, buffer) == -1)
+        {
+            close(source_fd);
+            close(destination_fd);
+            digest_table_free(&digests);
+            return -1;
+        }
+        report->bytes_resumed = journal.resumed_bytes;
+        report->blocks_redone = journal.redone_blocks;
+    }
+    stats_begin(opts->stats, total_size - report->bytes_resumed);
+    if (opts->sparse)
+    {
+        // Find the data before touching the destination, which loses its old contents here.
+        if (find_data_extents(source_fd, engine_size, &extents) == -1)
+        {
+            perror("find data extents");
+            status = -1;
+            goto done;
+        }
+        if (prepare_sparse_destination(destination_fd, total_size, &extents) == -1)
+        {
+            status = -1;
+            goto done;
+        }
+        report->extents = extents.count;
+        report->bytes_skipped = engine_size;
+        for (int i = 0; i < extents.count; i++) report->bytes_skipped -= extents.extents[i].end - extents.extents[i].start;
+    }
+    report->engine = (opts->engine == ACOPY_ENGINE_AUTO) ? ACOPY_ENGINE_COPY_FILE_RANGE : opts->engine;
+    for (;;)
+    {
+        if (report->engine == ACOPY_ENGINE_POSIX_AIO || report->engine == ACOPY_ENGINE_IO_URING)
+        {
+            if (opts->threads > 1)
+            {
+                status = copy_parallel(report->engine, source_fd, destination_fd, engine_size, alignment, opts, digesting, report);
+            }
+            else if (opts->auto_tune)
+            {
+                status = copy_auto_tuned(ctx, report->engine, source_fd, destination_fd, engine_size, alignment, opts, report);
+                // Tuning may have resized the pool, so pick it up again for the tail.
+                buffer = ctx_buffer(ctx, opts->block_size, alignment, opts->huge_pages);
+                if (!buffer) status = -1;
+            }
+            else if (opts->sparse)
+            {
+                status = copy_extents(report->engine, source_fd, destination_fd, &extents, buffer, opts);
+            }
+            else if (opts->resume)
+            {
+                status = copy_journaled(report->engine, source_fd, destination_fd, &journal, buffer, opts);
+            }
+            else if (coded)
+            {
+                status = copy_compressed(source_fd, destination_fd, &codec, engine_size, buffer, opts, &destination_size);
+            }
+            else
+            {
+                struct block_range range = {0, engine_size, opts->block_size};
+                status = copy_range(report->engine, source_fd, destination_fd, &range, buffer, opts, digesting);
+            }
+            break;
+        }
+        // Walk down the chain in auto mode until an engine works for this pair of files.
+        if (opts->sparse) status = copy_extents(report->engine, source_fd, destination_fd, &extents, buffer, opts);
+        else status = copy_zero_copy(report->engine, source_fd, destination_fd, 0, engine_size, opts);
+        if (status == 0) break;
+        if (opts->engine != ACOPY_ENGINE_AUTO || !zero_copy_unsupported(errno))
+        {
+            perror(acopy_engine_name(report->engine));
+            break;
+        }
+        report->engine = (report->engine == ACOPY_ENGINE_SPLICE) ? ACOPY_ENGINE_POSIX_AIO : report->engine + 1;
+    }
+    if (status == 0 && opts->direct && engine_size < total_size)
+    {
+        status = copy_tail_buffered(source_fd, destination_fd, engine_size, total_size, buffer, opts->block_size, digesting);
+    }
+    // Sets the exact length: a resumed copy may find a longer old destination.
+    if (status == 0 && ftruncate(destination_fd, destination_size) == -1)
+    {
+        perror("ftruncate");
+        status = -1;
+    }
+    // Until the journal is gone, the copy is not finished.
+    if (opts->resume && journal_close(&journal, status) == -1) status = -1;
+    if (status == 0)
+    {
+        // The flush belongs to the copy: the data is not where it was asked to go before it is done.
+        struct timespec flush_start, flush_finish;
+        clock_gettime(CLOCK_MONOTONIC, &flush_start);
+        status = durability_flush(source_fd, destination_fd, opts);
+        clock_gettime(CLOCK_MONOTONIC, &flush_finish);
+        report->flush_elapsed = timespec_diff(&flush_start, &flush_finish);
+    }
+done:
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    getrusage(RUSAGE_SELF, &usage_finish);
+
+    report->bytes = total_size - report->bytes_resumed;
+    if (coded)
+    {
+        // The bytes of a compressed copy are those of the original data, on whichever side it is.
+        report->bytes = opts->decompress ? destination_size : total_size;
+        report->codec = codec.codec;
+        report->frames = codec.index.count;
+        report->bytes_compressed = opts->decompress ? total_size : destination_size;
+    }
+    report->elapsed = timespec_diff(&start, &finish);
+    // RUSAGE_SELF covers every thread, including the glibc AIO helpers.
+    report->cpu_user = timeval_diff(&usage_start.ru_utime, &usage_finish.ru_utime);
+    report->cpu_sys = timeval_diff(&usage_start.ru_stime, &usage_finish.ru_stime);
+
+    // Once flushed, the extents are the ones on disk; before, delayed allocations may still be laid out differently.
+    report->destination_extents = (status == 0) ? count_extents(destination_fd, opts->durability != ACOPY_DURABILITY_NONE) : -1;
+    if (status == 0 && digesting)
+    {
+        report->digest = digest_table_combine(&digests, &report->digest_blocks);
+        if (opts->manifest && digest_table_write(&digests, opts->manifest, report->digest) == -1) status = -1;
+        if (status == 0 && opts->verify == ACOPY_VERIFY_READBACK)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            status = verify_readback(destination_fd, destination_path, &digests, buffer, &report->verify_mismatches);
+            clock_gettime(CLOCK_MONOTONIC, &finish);
+            report->verify_elapsed = timespec_diff(&start, &finish);
+            if (status == 0 && report->verify_mismatches > 0)
+            {
+                fprintf(stderr, "Verification failed: %ld of %ld blocks differ\n", report->verify_mismatches, report->digest_blocks);
+                status = -1;
+            }
+        }
+    }
+    digest_table_free(&digests);
+    extent_list_free(&extents);
+    codec_close(&codec);
+    close(source_fd);
+    close(destination_fd);
+    return status;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Print the timing, CPU usage and throughput of a finished copy.
+// -------------------------------------------------------------------------------------------------------
+void acopy_print_report(FILE *out, const struct acopy_opts *opts, const struct acopy_report *report)
+{
+    double cpu = report->cpu_user + report->cpu_sys;
+    const char *waiting = (report->engine == ACOPY_ENGINE_POSIX_AIO) ? acopy_completion_name(opts->completion) :
+                          (report->engine == ACOPY_ENGINE_IO_URING) ? "cqe" : "threads";
+    fprintf(out, "\nCopying was completed in %f seconds (%s%s, %s%s)\n", report->elapsed, acopy_engine_name(report->engine),
+            opts->engine == ACOPY_ENGINE_AUTO ? " via auto" : "", waiting, opts->direct ? ", direct" : "");
+    fprintf(out, "CPU time: %f seconds (user %f, sys %f), %.1f%% of one core\n", cpu, report->cpu_user, report->cpu_sys,
+            report->elapsed > 0 ? 100.0 * cpu / report->elapsed : 0.0);
+    fprintf(out, "Throughput: %.1f MB/s\n", report->elapsed > 0 ? report->bytes / report->elapsed / (1024 * 1024) : 0.0);
+    if (report->files || report->directories || report->failures)
+    {
+        fprintf(out, "Files: %ld (%.1f files/s), directories: %ld, failed: %ld\n", report->files,
+                report->elapsed > 0 ? report->files / report->elapsed : 0.0, report->directories, report->failures);
+    }
+    if (opts->sparse)
+    {
+        fprintf(out, "Sparse: %.1f MB of data in %d extents, %.1f MB of holes skipped\n",
+                (report->bytes - report->bytes_skipped) / (1024.0 * 1024), report->extents, report->bytes_skipped / (1024.0 * 1024));
+    }
+    if (opts->compress != ACOPY_CODEC_NONE || opts->decompress)
+    {
+        fprintf(out, "%s: %s, %.1f MB %s %.1f MB (%.2fx) in %ld frames\n", opts->decompress ? "Decompression" : "Compression",
+                acopy_codec_name(report->codec), (opts->decompress ? report->bytes_compressed : report->bytes) / (1024.0 * 1024),
+                opts->decompress ? "back to" : "into", (opts->decompress ? report->bytes : report->bytes_compressed) / (1024.0 * 1024),
+                report->bytes_compressed > 0 ? (double)report->bytes / report->bytes_compressed : 0.0, report->frames);
+    }
+    if (report->engine == ACOPY_ENGINE_MMAP)
+    {
+        fprintf(out, "Mapping: source windows %s\n", opts->mmap_copy ? "streamed into a mapped destination" : "written out with pwrite");
+    }
+    else if (opts->huge_pages)
+    {
+        fprintf(out, "Buffers: %.1f MB in %s\n", report->buffer_bytes / (1024.0 * 1024),
+                report->buffer_pages == ACOPY_PAGES_HUGETLB ? "reserved huge pages (hugetlb)" :
+                report->buffer_pages == ACOPY_PAGES_THP ? "transparent huge pages" : "normal pages, no huge pages available");
+    }
+    if (report->hdd)
+    {
+        fprintf(out, "HDD mode: one read at a time in file order, writes in file order%s\n",
+                opts->hdd == ACOPY_HDD_AUTO ? " (rotational device detected)" : "");
+    }
+    if (report->destination_extents > 0)
+    {
+        fprintf(out, "Layout: %d extents in the destination, %.1f MB per extent%s\n", report->destination_extents,
+                (report->bytes + report->bytes_resumed - report->bytes_skipped) / (1024.0 * 1024) / report->destination_extents,
+                opts->durability == ACOPY_DURABILITY_NONE ? " (before write-back)" : "");
+    }
+    if (opts->throttle) acopy_throttle_print(out, opts->throttle);
+    if (opts->durability == ACOPY_DURABILITY_DSYNC)
+    {
+        fprintf(out, "Flush: every write waited for the device (dsync)\n");
+    }
+    else if (opts->durability != ACOPY_DURABILITY_NONE)
+    {
+        fprintf(out, "Flush: %f seconds (%s), %.1f%% of the copy\n", report->flush_elapsed, acopy_durability_name(opts->durability),
+                report->elapsed > 0 ? 100.0 * report->flush_elapsed / report->elapsed : 0.0);
+    }
+    if (report->bytes_resumed || report->blocks_redone)
+    {
+        fprintf(out, "Resumed: %.1f MB were already copied and skipped, %ld blocks failed validation and were copied again\n",
+                report->bytes_resumed / (1024.0 * 1024), report->blocks_redone);
+    }
+    if (opts->verify != ACOPY_VERIFY_NONE)
+    {
+        fprintf(out, "Verify: crc32c %08x over %ld blocks%s\n", (unsigned)report->digest, report->digest_blocks,
+                opts->manifest ? ", manifest written" : "");
+    }
+    if (opts->verify == ACOPY_VERIFY_READBACK)
+    {
+        fprintf(out, "Read-back: %ld mismatching blocks, %f seconds (%.1f MB/s)\n", report->verify_mismatches, report->verify_elapsed,
+                report->verify_elapsed > 0 ? report->bytes / report->verify_elapsed / (1024 * 1024) : 0.0);
+    }
+    if (report->tuned_block_size)
+    {
+        fprintf(out, "Auto-tuned: %zu KB blocks, %d operations (%s after %d windows)\n", report->tuned_block_size / 1024,
+                report->tuned_num_async_ops, report->tune_settled ? "settled" : "still climbing", report->tune_windows);
+    }
+
+    if (report->num_workers > 0)
+    {
+        // Per-worker results show how evenly the ranges were spread over the device.
+        double fastest = 0, slowest = 0;
+        for (int i = 0; i < report->num_workers; i++)
+        {
+            const struct acopy_worker_report *worker = &report->workers[i];
+            fprintf(out, "  Worker %3d (cpu %3d): %12lld bytes in %f seconds, %.1f MB/s\n", i, worker->cpu, (long long)worker->bytes,
+                    worker->elapsed, worker->elapsed > 0 ? worker->bytes / worker->elapsed / (1024 * 1024) : 0.0);
+            if (i == 0 || worker->elapsed < fastest) fastest = worker->elapsed;
+            if (worker->elapsed > slowest) slowest = worker->elapsed;
+        }
+        fprintf(out, "Worker imbalance: slowest %f s, fastest %f s (%.2fx)\n", slowest, fastest, fastest > 0 ? slowest / fastest : 0.0);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Drop a file from the page cache so consecutive runs start equally cold.
+// -------------------------------------------------------------------------------------------------------
+void acopy_drop_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
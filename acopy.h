@@ -0,0 +1,217 @@
+#ifndef ACOPY_H
+#define ACOPY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// -------------------------------------------------------------------------------------------------------
+// Linux Async Copying library.
+// The copy engines behind the async_copy executables and the measuring harness. A program that copies
+// many files keeps one acopy_ctx and runs every transfer through it, so buffers are set up only once.
+// -------------------------------------------------------------------------------------------------------
+
+// Define the maximum number of I/O operations that can be pending at the same time.
+#define ACOPY_MAX_IO_OPERATIONS 4096
+// Upper bound for the number of worker threads.
+#define ACOPY_MAX_THREADS 256
+
+// Copy engines.
+enum acopy_engine
+{
+    ACOPY_ENGINE_POSIX_AIO,        // glibc POSIX AIO (user-space thread pool)
+    ACOPY_ENGINE_IO_URING,         // kernel io_uring with linked read->write SQEs
+    ACOPY_ENGINE_COPY_FILE_RANGE,  // copy_file_range(), may reflink or copy server-side
+    ACOPY_ENGINE_SENDFILE,         // sendfile() from the source into the destination
+    ACOPY_ENGINE_SPLICE,           // splice() through a pipe
+    ACOPY_ENGINE_MMAP,             // map source windows and write from them, or copy into a mapped destination
+    ACOPY_ENGINE_AUTO              // copy_file_range, then sendfile, then splice, then POSIX AIO
+};
+
+// How the POSIX AIO engine waits for completions.
+enum acopy_completion
+{
+    ACOPY_COMPLETION_SPIN,    // busy-poll aio_error() over every slot
+    ACOPY_COMPLETION_SUSPEND, // block in aio_suspend() on the operations still in flight
+    ACOPY_COMPLETION_SIGNAL,  // SIGEV_SIGNAL delivered through a signalfd
+    ACOPY_COMPLETION_THREAD   // SIGEV_THREAD callback that bumps an eventfd
+};
+
+// End-to-end verification of a copy.
+enum acopy_verify
+{
+    ACOPY_VERIFY_NONE,
+    ACOPY_VERIFY_INLINE,   // CRC32C of every block while it is in the buffer between its read and its write
+    ACOPY_VERIFY_READBACK  // inline, then read the destination back and compare every block
+};
+
+// When the copied data is made durable.
+enum acopy_durability
+{
+    ACOPY_DURABILITY_NONE,        // leave the dirty pages to the kernel
+    ACOPY_DURABILITY_END,         // fdatasync() the destination once the copy is done
+    ACOPY_DURABILITY_WRITEBEHIND, // sync_file_range() write-behind every few MB, drop both files from the page cache
+    ACOPY_DURABILITY_DSYNC        // open the destination O_DSYNC, so every write waits for the device
+};
+
+// HDD mode: reads one at a time in file order, writes in file order, read-ahead on the source.
+enum acopy_hdd
+{
+    ACOPY_HDD_AUTO, // on when sysfs says the source or the destination is on a rotational device
+    ACOPY_HDD_OFF,
+    ACOPY_HDD_ON
+};
+
+// Block compression: every block becomes an independent frame, and an index of the frames ends the file.
+enum acopy_codec
+{
+    ACOPY_CODEC_NONE,
+    ACOPY_CODEC_LZ4,  // LZ4 frames, from liblz4 loaded at run time
+    ACOPY_CODEC_ZSTD  // zstd frames, from libzstd loaded at run time
+};
+
+// Memory behind the buffer pool of the posix-aio and io_uring engines.
+enum acopy_pages
+{
+    ACOPY_PAGES_NORMAL,  // posix_memalign()
+    ACOPY_PAGES_THP,     // anonymous mapping aligned to a huge page and marked MADV_HUGEPAGE
+    ACOPY_PAGES_HUGETLB  // MAP_HUGETLB from the reserved huge page pool
+};
+
+// Live instrumentation shared by the engine loops, see acopy_stats_new().
+struct acopy_stats;
+// Rate limits shared by the engine loops, see acopy_throttle_new().
+struct acopy_throttle;
+
+// Options for one copy run. acopy_opts_init() fills in the defaults.
+struct acopy_opts
+{
+    enum acopy_engine engine;
+    enum acopy_completion completion;
+    size_t block_size;      // Block size in bytes.
+    int num_async_ops;      // Number of asynchronous operations kept in flight.
+    int direct;             // Open both files with O_DIRECT and bypass the page cache.
+    int threads;            // Worker threads for posix-aio/io_uring, each with its own queue and buffers.
+    int stripes;            // Hand out interleaved stripes of block_size instead of contiguous ranges.
+    int auto_tune;          // Hill-climb block_size and num_async_ops while copying, starting from the cached best.
+    size_t memory_cap;      // Largest buffer pool auto-tuning may grow to, in bytes.
+    int sparse;             // Copy only the data extents of the source and leave holes in the destination.
+    struct acopy_stats *stats; // Record latencies, depth and progress here while copying, NULL for none.
+    enum acopy_verify verify; // Hash the blocks with the posix-aio or io_uring engine.
+    const char *manifest;   // Write the block digests to this file when verifying, NULL for none.
+    int resume;             // Keep a journal next to the destination and skip the blocks it already has.
+    enum acopy_durability durability;
+    off_t writebehind_bytes; // Write-behind window in bytes.
+    int preallocate;        // Allocate the full size of the destination before the first write.
+    int ordered_writes;     // Start the writes in file order, whatever order the reads complete in.
+    enum acopy_hdd hdd;
+    off_t readahead_bytes;  // Ask the kernel to read the source this far ahead of the copy, 0 for none (16 MB in HDD mode).
+    struct acopy_throttle *throttle; // Limit the rate blocks are copied at, NULL for none.
+    enum acopy_codec compress; // Compress every block before it is written, with the posix-aio engine.
+    int compress_level;     // zstd level, 0 for the library default; lz4 has only one.
+    int compress_threads;   // Threads compressing or decompressing blocks, 0 for one per online core.
+    int decompress;         // The source was written by a compressed copy: write out the data it holds.
+    int mmap_copy;          // mmap engine: map the destination too and copy with streaming stores, instead of writing from the source mapping.
+    int huge_pages;         // Back the buffer pool with huge pages: MAP_HUGETLB while the reserved pool has room, else transparent huge pages.
+    int aio_threads;        // glibc AIO helper threads, 0 to size the pool to the queue depth. Set by the first posix-aio copy of the process.
+    int aio_idle_time;      // Seconds an idle glibc AIO helper thread waits for work before it exits, 0 for the glibc default.
+};
+
+// What one parallel worker measured.
+struct acopy_worker_report
+{
+    int cpu;                // Core the worker was pinned to, -1 if pinning failed.
+    off_t bytes;            // Bytes in the worker's blocks.
+    double elapsed;         // Wall time of the worker in seconds.
+};
+
+// What a copy run measured.
+struct acopy_report
+{
+    off_t bytes;            // Bytes copied.
+    double elapsed;         // Wall time in seconds.
+    double cpu_user;        // User CPU time in seconds, all threads.
+    double cpu_sys;         // System CPU time in seconds, all threads.
+    enum acopy_engine engine; // Engine that actually did the copy (differs from the request in auto mode).
+    long files;             // Regular files copied by acopy_tree().
+    long directories;       // Directories created by acopy_tree().
+    long failures;          // Entries of the tree that could not be copied.
+    off_t bytes_skipped;    // Bytes of holes that were not read or written in a sparse copy.
+    int extents;            // Data extents copied in a sparse copy.
+    size_t tuned_block_size; // Block size auto-tuning settled on, 0 without auto-tuning.
+    int tuned_num_async_ops; // Operations in flight auto-tuning settled on.
+    int tune_windows;       // Measurement windows the auto-tuned copy was split into.
+    int tune_settled;       // No neighbouring point was faster, so the search stopped.
+    uint32_t digest;        // CRC32C of the copied data when verifying.
+    long digest_blocks;     // Blocks hashed when verifying.
+    long verify_mismatches; // Blocks whose read-back digest differs.
+    double verify_elapsed;  // Wall time of the read-back pass in seconds, not part of elapsed.
+    off_t bytes_resumed;    // Bytes a resumed copy found already done and skipped.
+    long blocks_redone;     // Blocks the journal listed that failed validation and were copied again.
+    double flush_elapsed;   // Wall time of the final flush in seconds, part of elapsed.
+    int destination_extents; // Extents the destination ended up in, -1 if the filesystem cannot tell.
+    int hdd;                // The copy ran in HDD mode.
+    enum acopy_codec codec; // Codec of a compressed copy or of the source of a decompressing one.
+    off_t bytes_compressed; // Size of the compressed file, its frames and its index.
+    long frames;            // Frames in the compressed file.
+    enum acopy_pages buffer_pages; // What the buffer pool ended up in.
+    size_t buffer_bytes;    // Size of the buffer pool.
+    int num_workers;        // Parallel workers used, 0 for a single-threaded copy.
+    struct acopy_worker_report workers[ACOPY_MAX_THREADS];
+};
+
+// Reusable copy context.
+struct acopy_ctx;
+
+void acopy_opts_init(struct acopy_opts *opts);
+// Returns -1 with a message on stderr if the options cannot work together.
+int acopy_opts_check(const struct acopy_opts *opts);
+
+struct acopy_ctx *acopy_ctx_new(void);
+void acopy_ctx_free(struct acopy_ctx *ctx);
+
+// Copy one file. Returns 0 on success, -1 on failure with the reason already printed to stderr.
+int acopy_file(struct acopy_ctx *ctx, const char *source_path, const char *destination_path, const struct acopy_opts *opts, struct acopy_report *report);
+// Copy a directory tree through one shared pool of in-flight operations, keeping mode bits and times.
+int acopy_tree(struct acopy_ctx *ctx, const char *source_path, const char *destination_path, const struct acopy_opts *opts, struct acopy_report *report);
+
+const char *acopy_engine_name(enum acopy_engine engine);
+int acopy_engine_parse(const char *name, enum acopy_engine *engine);
+const char *acopy_completion_name(enum acopy_completion completion);
+int acopy_completion_parse(const char *name, enum acopy_completion *completion);
+const char *acopy_durability_name(enum acopy_durability durability);
+int acopy_durability_parse(const char *name, enum acopy_durability *durability);
+const char *acopy_codec_name(enum acopy_codec codec);
+int acopy_codec_parse(const char *name, enum acopy_codec *codec);
+
+// Print the timing, CPU usage and throughput of a finished copy.
+void acopy_print_report(FILE *out, const struct acopy_opts *opts, const struct acopy_report *report);
+// Drop a file from the page cache so consecutive runs start equally cold.
+void acopy_drop_cache(const char *path);
+
+// Instrumentation. The copy records into the stats with atomics only; a watcher calls acopy_stats_sample()
+// every so often to feed the moving throughput window and the depth series, and prints from any thread.
+struct acopy_stats *acopy_stats_new(void);
+void acopy_stats_free(struct acopy_stats *stats);
+void acopy_stats_sample(struct acopy_stats *stats);
+// One line: bytes done, current and average throughput, depth, p99 latencies, submit and wait time.
+void acopy_stats_print_progress(FILE *out, struct acopy_stats *stats);
+// Everything, including the latency histograms and the depth series, as JSON.
+void acopy_stats_print_json(FILE *out, struct acopy_stats *stats);
+
+// Throttling. One throttle holds a byte rate and a rate of operations (blocks copied, each a read and a write)
+// for every engine loop and thread of a copy. Any thread may change it while copying. Feedback mode needs
+// opts.stats: it lowers the byte rate while the mean completion latency is above the target.
+struct acopy_throttle *acopy_throttle_new(void);
+void acopy_throttle_free(struct acopy_throttle *throttle);
+// Rates per second, 0 for no limit.
+void acopy_throttle_set(struct acopy_throttle *throttle, uint64_t bytes_per_second, uint64_t ops_per_second);
+// Latency target in microseconds, 0 to turn the feedback off.
+void acopy_throttle_set_target(struct acopy_throttle *throttle, uint64_t target_us);
+// One line: the limits, the target and the byte rate the feedback is at.
+void acopy_throttle_print(FILE *out, struct acopy_throttle *throttle);
+
+// Command line front end shared by the async_copy executables.
+int acopy_main(int argc, char *argv[], enum acopy_completion default_completion);
+
+#endif
@@ -0,0 +1,690 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <aio.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include "acopy_internal.h"
+
+// Helper threads glibc starts at most by default, and the most the copy sizes the pool to on its own.
+#define AIO_DEFAULT_THREADS 20
+#define AIO_MAX_THREADS 1024
+// Completion signals taken from the signalfd per read.
+#define SIGNAL_BATCH 64
+// Milliseconds without a completion signal after which signal mode looks at every slot.
+#define SIGNAL_SWEEP_MS 100
+
+struct aio_context;
+
+// State of a block buffer in the POSIX AIO loop.
+enum slot_state
+{
+    SLOT_IDLE,    // free, waiting for the next block to read
+    SLOT_READING, // read of the block (or of its remainder after a short read) in flight
+    SLOT_TRANSFORMING, // block read, being compressed or decompressed by a codec thread
+    SLOT_READ,    // block read (and transformed), waiting for the blocks before it to be written (ordered writes only)
+    SLOT_WRITING, // write of the block (or of its remainder after a short write) in flight
+    SLOT_DONE     // failed, takes no more blocks
+};
+
+// Per-slot bookkeeping that goes with each aiocb.
+struct copy_slot
+{
+    enum slot_state state;
+    char *buf;     // Block buffer owned by this slot.
+    char *in, *out; // Where the block is read into and written from: buf, or a codec frame buffer.
+    struct copy_block block;
+    off_t out_offset;  // Where the block is written, block.offset unless a codec moves it.
+    size_t out_length; // Bytes written, block.length unless a codec changes it.
+    size_t done;   // Bytes of the current read or write already transferred.
+    int retry;     // The block could not be submitted yet and is still owned by the slot.
+    uint64_t submitted_ns; // When the current read or write was submitted, for the latency histograms.
+    uint64_t sequence;     // Position of the block in hand-out order, for ordered writes.
+    struct hash_job hash;  // Digest of the block, taken while it is being written.
+    struct codec_job transform;
+    int index;             // Position in the slot list, which is also that of the slot's aiocb.
+    struct aio_context *owner;
+    struct sigevent notification; // How the operations of this slot report their completion.
+};
+
+// Realtime signal used for SIGEV_SIGNAL completions.
+#define COMPLETION_SIGNO (SIGRTMIN + 1)
+
+// State of one POSIX AIO copy loop. Each parallel worker owns one, so nothing is shared on the hot path.
+// The slots are sized to the queue depth of the copy. The notifications of the signal and thread modes
+// name the slot whose operation finished, and the slot goes on the ready queue, so the loop only looks at
+// slots that have something to do; spin and suspend mode have nothing to go by and look at every slot.
+struct aio_context
+{
+    // Structure to hold the control block information for our asynchronous I/O operations.
+    struct aiocb *aiocb_list;
+    struct copy_slot *slot_list;
+    int num_slots;
+    // Notification attached to every aiocb, and the descriptor the loop blocks on.
+    struct sigevent notification;
+    int completion_fd;
+    uint64_t notifications_owed; // Submitted operations whose SIGEV_THREAD callback has not been seen yet.
+    // Ready queue: ring of the slots whose operation finished, pushed by the SIGEV_THREAD callbacks on the
+    // glibc helper threads or by the loop itself for signals. If it overflows, sweep is set and the next
+    // pass looks at every slot instead.
+    pthread_mutex_t ready_lock;
+    int *ready;
+    int ready_head, ready_count;
+    int sweep;
+    int *idle;        // Stack of idle slots; a slot whose read could not be submitted stays on it.
+    int idle_count;
+    int *order;       // Ordered writes: the slot of every block handed out, by sequence modulo the slot count.
+    const struct aiocb **wait_list; // aio_suspend() list.
+};
+
+static struct aio_context *aio_context_new(int num_slots)
+{
+    struct aio_context *ctx = calloc(1, sizeof(struct aio_context));
+    if (!ctx)
+    {
+        perror("calloc");
+        return NULL;
+    }
+    ctx->num_slots = num_slots;
+    ctx->aiocb_list = calloc(num_slots, sizeof(struct aiocb));
+    ctx->slot_list = calloc(num_slots, sizeof(struct copy_slot));
+    ctx->ready = calloc(num_slots, sizeof(int));
+    ctx->idle = calloc(num_slots, sizeof(int));
+    ctx->order = calloc(num_slots, sizeof(int));
+    ctx->wait_list = calloc(num_slots, sizeof(struct aiocb *));
+    if (!ctx->aiocb_list || !ctx->slot_list || !ctx->ready || !ctx->idle || !ctx->order || !ctx->wait_list)
+    {
+        perror("calloc");
+        free(ctx->aiocb_list);
+        free(ctx->slot_list);
+        free(ctx->ready);
+        free(ctx->idle);
+        free(ctx->order);
+        free(ctx->wait_list);
+        free(ctx);
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->ready_lock, NULL);
+    return ctx;
+}
+
+static void aio_context_free(struct aio_context *ctx)
+{
+    pthread_mutex_destroy(&ctx->ready_lock);
+    free(ctx->aiocb_list);
+    free(ctx->slot_list);
+    free(ctx->ready);
+    free(ctx->idle);
+    free(ctx->order);
+    free(ctx->wait_list);
+    free(ctx);
+}
+
+static void ready_push(struct aio_context *ctx, int index)
+{
+    pthread_mutex_lock(&ctx->ready_lock);
+    if (ctx->ready_count == ctx->num_slots) ctx->sweep = 1;
+    else ctx->ready[(ctx->ready_head + ctx->ready_count++) % ctx->num_slots] = index;
+    pthread_mutex_unlock(&ctx->ready_lock);
+}
+
+// Next ready slot, -1 when there is none.
+static int ready_pop(struct aio_context *ctx)
+{
+    int index = -1;
+    pthread_mutex_lock(&ctx->ready_lock);
+    if (ctx->ready_count > 0)
+    {
+        index = ctx->ready[ctx->ready_head];
+        ctx->ready_head = (ctx->ready_head + 1) % ctx->num_slots;
+        ctx->ready_count--;
+    }
+    pthread_mutex_unlock(&ctx->ready_lock);
+    return index;
+}
+
+// Whether the next pass has to look at every slot; clears the flag.
+static int ready_sweep(struct aio_context *ctx)
+{
+    pthread_mutex_lock(&ctx->ready_lock);
+    int sweep = ctx->sweep;
+    ctx->sweep = 0;
+    pthread_mutex_unlock(&ctx->ready_lock);
+    return sweep;
+}
+
+static void slot_release(struct aio_context *ctx, struct copy_slot *slot)
+{
+    slot->state = SLOT_IDLE;
+    ctx->idle[ctx->idle_count++] = slot->index;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Function to set up an asynchronous read operation.
+// -------------------------------------------------------------------------------------------------------
+static int aio_read_setup(struct aiocb *aiocbp, int fd, off_t offset, volatile void *buf, size_t size, const struct sigevent *notification)
+{
+    memset(aiocbp, 0, sizeof(struct aiocb)); // Clear out the aiocb structure to zero.
+    aiocbp->aio_fildes = fd;                 // File descriptor for the file to read from.
+    aiocbp->aio_buf = buf;                   // Buffer to read the data into.
+    aiocbp->aio_nbytes = size;               // Number of bytes to read.
+    aiocbp->aio_offset = offset;             // Offset in the file to start reading from.
+    aiocbp->aio_sigevent = *notification;    // How the completion is reported.
+    if (aio_read(aiocbp) == -1)              // Initiate the read operation.
+    {
+        return -1;                           // errno is set by aio_read; the caller decides what to do.
+    }
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Function to set up an asynchronous write operation.
+// -------------------------------------------------------------------------------------------------------
+static int aio_write_setup(struct aiocb *aiocbp, int fd, off_t offset, volatile void *buf, size_t size, const struct sigevent *notification)
+{
+    memset(aiocbp, 0, sizeof(struct aiocb)); // Clear out the aiocb structure to zero.
+    aiocbp->aio_fildes = fd;                 // File descriptor for the file to write to.
+    aiocbp->aio_buf = buf;                   // Buffer with the data to write.
+    aiocbp->aio_nbytes = size;               // Number of bytes to write.
+    aiocbp->aio_offset = offset;             // Offset in the file to start writing to.
+    aiocbp->aio_sigevent = *notification;    // How the completion is reported.
+    if (aio_write(aiocbp) == -1)             // Initiate the write operation.
+    {
+        return -1;                           // errno is set by aio_write; the caller decides what to do.
+    }
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// glibc AIO thread pool.
+// glibc takes its pool size from aio_init() when the first request comes in and keeps it for the life of
+// the process: 20 helper threads by default, however deep the queue. Unless told otherwise, a posix-aio
+// copy sizes the pool to the operations it keeps in flight over all its workers, up to 1024 threads.
+// -------------------------------------------------------------------------------------------------------
+void aio_configure(const struct acopy_opts *opts)
+{
+    struct aioinit init;
+    int depth = opts->num_async_ops * opts->threads;
+    memset(&init, 0, sizeof(init));
+    if (opts->aio_threads > 0) init.aio_threads = opts->aio_threads;
+    else init.aio_threads = (depth < AIO_DEFAULT_THREADS) ? AIO_DEFAULT_THREADS : (depth > AIO_MAX_THREADS) ? AIO_MAX_THREADS : depth;
+    // Requests in flight at once: a read or a write on every slot.
+    init.aio_num = 2 * depth;
+    init.aio_idle_time = opts->aio_idle_time; // 0 keeps the glibc default of a second.
+    aio_init(&init);
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Completion notification for the POSIX AIO loop.
+// -------------------------------------------------------------------------------------------------------
+static void completion_wake(struct aio_context *ctx)
+{
+    uint64_t one = 1;
+    if (write(ctx->completion_fd, &one, sizeof(one)) == -1) perror("write eventfd");
+}
+
+static void completion_thread_notify(union sigval value)
+{
+    struct copy_slot *slot = value.sival_ptr;
+    // Runs on a glibc AIO helper thread: queue the slot and wake the copy loop through the eventfd.
+    ready_push(slot->owner, slot->index);
+    completion_wake(slot->owner);
+}
+
+// Called on a codec thread for every transformed block: wake the copy loop the way a completion would,
+// without naming a slot.
+static void completion_transform_notify(void *arg)
+{
+    struct aio_context *ctx = arg;
+    union sigval none = {.sival_int = -1};
+    if (ctx->notification.sigev_notify == SIGEV_THREAD) completion_wake(ctx);
+    else if (ctx->notification.sigev_notify == SIGEV_SIGNAL && sigqueue(getpid(), COMPLETION_SIGNO, none) == -1) perror("sigqueue");
+}
+
+static int completion_init(struct aio_context *ctx, enum acopy_completion mode)
+{
+    memset(&ctx->notification, 0, sizeof(ctx->notification));
+    ctx->notification.sigev_notify = SIGEV_NONE;
+    ctx->completion_fd = -1;
+
+    if (mode == ACOPY_COMPLETION_SIGNAL)
+    {
+        // Block the signal before any AIO helper thread exists so it stays pending for the signalfd.
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, COMPLETION_SIGNO);
+        if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) return -1;
+        ctx->completion_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+        if (ctx->completion_fd == -1) return -1;
+        ctx->notification.sigev_notify = SIGEV_SIGNAL;
+        ctx->notification.sigev_signo = COMPLETION_SIGNO;
+    }
+    else if (mode == ACOPY_COMPLETION_THREAD)
+    {
+        ctx->completion_fd = eventfd(0, EFD_CLOEXEC);
+        if (ctx->completion_fd == -1) return -1;
+        ctx->notification.sigev_notify = SIGEV_THREAD;
+        ctx->notification.sigev_notify_function = completion_thread_notify;
+    }
+    // Every slot's notification names the slot: its address for the callbacks, its index for the signals.
+    for (int i = 0; i < ctx->num_slots; i++)
+    {
+        struct copy_slot *slot = &ctx->slot_list[i];
+        slot->index = i;
+        slot->owner = ctx;
+        slot->notification = ctx->notification;
+        if (mode == ACOPY_COMPLETION_THREAD) slot->notification.sigev_value.sival_ptr = slot;
+        else slot->notification.sigev_value.sival_int = i;
+    }
+    return 0;
+}
+
+// Block until at least one operation in flight may have completed. aio_suspend() cannot see the codec
+// threads, so with transforms pending it returns after a millisecond at the latest.
+static int completion_wait(struct aio_context *ctx, enum acopy_completion mode, int num_slots, int transforms)
+{
+    if (mode == ACOPY_COMPLETION_SUSPEND)
+    {
+        const struct aiocb **wait_list = ctx->wait_list;
+        int count = 0;
+        for (int i = 0; i < num_slots; i++)
+        {
+            if (ctx->slot_list[i].state != SLOT_READING && ctx->slot_list[i].state != SLOT_WRITING) continue;
+            // A finished operation would make aio_suspend return at once, so let the scan pick it up.
+            if (aio_error(&ctx->aiocb_list[i]) != EINPROGRESS) return 0;
+            wait_list[count++] = &ctx->aiocb_list[i];
+        }
+        if (count == 0) return 0;
+        struct timespec tick = {0, 1000000};
+        while (aio_suspend(wait_list, count, transforms ? &tick : NULL) == -1)
+        {
+            if (errno == EAGAIN && transforms) break;
+            if (errno != EINTR && errno != EAGAIN) return -1;
+        }
+    }
+    else if (mode == ACOPY_COMPLETION_SIGNAL)
+    {
+        // Pending signals queue up while we scan, so none of them is lost between scan and read. A signal that
+        // cannot be queued (RLIMIT_SIGPENDING) is not sent at all, though: glibc only marks its operation failed.
+        // When nothing arrives for a while the next pass therefore sweeps every slot.
+        struct signalfd_siginfo info[SIGNAL_BATCH];
+        struct pollfd signals = {ctx->completion_fd, POLLIN, 0};
+        ssize_t got;
+        int ready;
+        while ((ready = poll(&signals, 1, SIGNAL_SWEEP_MS)) == -1)
+        {
+            if (errno != EINTR) return -1;
+        }
+        if (ready == 0)
+        {
+            pthread_mutex_lock(&ctx->ready_lock);
+            ctx->sweep = 1;
+            pthread_mutex_unlock(&ctx->ready_lock);
+            return 0;
+        }
+        while ((got = read(ctx->completion_fd, info, sizeof(info))) == -1)
+        {
+            if (errno != EINTR) return -1;
+        }
+        for (size_t i = 0; i < got / sizeof(info[0]); i++)
+        {
+            // Codec wake-ups carry -1, and a signal left over from an earlier copy may name any slot.
+            int index = (int)info[i].ssi_int;
+            if (index >= 0 && index < ctx->num_slots) ready_push(ctx, index);
+        }
+    }
+    else if (mode == ACOPY_COMPLETION_THREAD)
+    {
+        uint64_t count;
+        while (read(ctx->completion_fd, &count, sizeof(count)) == -1)
+        {
+            if (errno != EINTR) return -1;
+        }
+        ctx->notifications_owed -= count;
+    }
+    return 0;
+}
+
+static void completion_teardown(struct aio_context *ctx, enum acopy_completion mode)
+{
+    // A callback can still be on its way after aio_error() reported the result: wait for all of them
+    // before the eventfd and the context go away.
+    while (mode == ACOPY_COMPLETION_THREAD && ctx->notifications_owed > 0)
+    {
+        if (completion_wait(ctx, mode, 0, 0) == -1) break;
+    }
+    if (ctx->completion_fd != -1) close(ctx->completion_fd);
+    ctx->completion_fd = -1;
+}
+
+
+// -------------------------------------------------------------------------------------------------------
+// Copy loop built on POSIX AIO.
+// Reads and writes are decoupled: up to num_async_ops reads are kept in flight over 2 * num_async_ops
+// slots, and a block's write is started as soon as its read is complete. Short reads and writes are
+// resubmitted for the remainder. Buffers must hold 2 * num_async_ops blocks.
+// Idle slots come off a stack and finished ones off the ready queue, so with signal or thread completions
+// a pass costs the same at a depth of thousands as at a depth of one.
+// With a codec, a read block goes to the codec threads first, and what they make of it is written.
+// -------------------------------------------------------------------------------------------------------
+int aio_copy_loop(struct block_feeder *feeder, char *buffer, size_t block_size, int num_async_ops, enum acopy_completion mode)
+{
+    int num_slots = 2 * num_async_ops;
+    int reads_in_flight = 0;
+    int ops_in_flight = 0;
+    int transforms_in_flight = 0;
+    int feeder_finished = 0;
+    int status = 0;
+    struct acopy_stats *stats = feeder->stats;
+    struct block_hasher hasher, *hashing = NULL;
+    struct block_codec *codec = feeder->codec;
+    int ordered = feeder->ordered;
+    int read_depth = feeder->sequential ? 1 : num_async_ops;
+    uint64_t handed_out = 0, next_write = 0; // Ordered writes: blocks handed out, and the next one to write.
+
+    struct aio_context *ctx = aio_context_new(num_slots);
+    if (!ctx) return -1;
+    if (feeder->digests)
+    {
+        if (hasher_start(&hasher, feeder->digests) == -1)
+        {
+            aio_context_free(ctx);
+            return -1;
+        }
+        hashing = &hasher;
+    }
+    struct aiocb *aiocb_list = ctx->aiocb_list;
+    struct copy_slot *slot_list = ctx->slot_list;
+    if (completion_init(ctx, mode) == -1)
+    {
+        perror("completion_init");
+        hasher_stop(hashing);
+        aio_context_free(ctx);
+        return -1;
+    }
+    if (codec && codec_start(codec, num_slots, completion_transform_notify, ctx) == -1)
+    {
+        completion_teardown(ctx, mode);
+        hasher_stop(hashing);
+        aio_context_free(ctx);
+        return -1;
+    }
+    // Pushed last to first, so the first blocks go to the first slots.
+    for (int i = num_slots - 1; i >= 0; i--)
+    {
+        slot_list[i].buf = slot_list[i].in = slot_list[i].out = buffer + (i * block_size);
+        if (codec) codec_buffers(codec, i, slot_list[i].buf, &slot_list[i].in, &slot_list[i].out);
+        slot_release(ctx, &slot_list[i]);
+    }
+
+    for (;;)
+    {
+        // Start reads on idle slots while the read depth allows it.
+        while (ctx->idle_count > 0 && status == 0 && reads_in_flight < read_depth)
+        {
+            int i = ctx->idle[ctx->idle_count - 1];
+            struct copy_slot *slot = &slot_list[i];
+            if (!slot->retry)
+            {
+                if (feeder_finished) break;
+                // Only block for new work when nothing is in flight that could wake us up instead.
+                int got = feeder_next(feeder, &slot->block, ops_in_flight + transforms_in_flight == 0);
+                if (got == -1) feeder_finished = 1;
+                if (got != 1) break;
+                slot->done = 0;
+                slot->sequence = handed_out++;
+                ctx->order[slot->sequence % num_slots] = i;
+            }
+            uint64_t submit_start = stats_clock(stats);
+            if (aio_read_setup(&aiocb_list[i], slot->block.source_fd, slot->block.offset, slot->in, slot->block.length, &slot->notification) == -1)
+            {
+                // glibc could not get a helper thread: retry once something completes.
+                slot->retry = 1;
+                if (errno == EAGAIN && ops_in_flight > 0) break;
+                perror("aio_read");
+                feeder_done(feeder, &slot->block, -1);
+                slot->retry = 0;
+                slot->state = SLOT_DONE;
+                ctx->idle_count--;
+                status = -1;
+                break;
+            }
+            ctx->idle_count--;
+            slot->submitted_ns = stats_submit(stats, submit_start);
+            stats_depth(stats, 1);
+            slot->retry = 0;
+            slot->state = SLOT_READING;
+            reads_in_flight++;
+            ops_in_flight++;
+            ctx->notifications_owed++;
+        }
+        if (ops_in_flight + transforms_in_flight == 0)
+        {
+            if (feeder_finished || status == -1) break;
+            continue;
+        }
+
+        uint64_t wait_start = stats_clock(stats);
+        if (ops_in_flight == 0 && (mode == ACOPY_COMPLETION_SPIN || mode == ACOPY_COMPLETION_SUSPEND))
+        {
+            // Only a codec thread can finish anything, and it does not wake these modes.
+            codec_wait(codec);
+        }
+        else if (completion_wait(ctx, mode, num_slots, transforms_in_flight) == -1)
+        {
+            // Without a working notification fall back to polling so the buffers are not freed under the I/O.
+            perror("completion_wait");
+            mode = ACOPY_COMPLETION_SPIN;
+            status = -1;
+        }
+        stats_wait(stats, wait_start);
+
+        // A pass that finds nothing finished counts as waiting too; that is all the time spin mode waits.
+        uint64_t scan_start = stats_clock(stats);
+        int completed = 0;
+        int sweep = (mode == ACOPY_COMPLETION_SPIN || mode == ACOPY_COMPLETION_SUSPEND || ready_sweep(ctx));
+        for (int n = 0;; n++)
+        {
+            // Every slot, or the ones the notifications reported. A slot may be reported again after a
+            // sweep has handled it; its state or aio_error() then says there is nothing to do.
+            int i = sweep ? n : ready_pop(ctx);
+            if (i == -1 || i == num_slots) break;
+            struct copy_slot *slot = &slot_list[i];
+            struct copy_block *block = &slot->block;
+            if (slot->state != SLOT_READING && slot->state != SLOT_WRITING) continue;
+            int err = aio_error(&aiocb_list[i]);
+            if (err == EINPROGRESS) continue;
+
+            ssize_t ret = aio_return(&aiocb_list[i]);
+            ops_in_flight--;
+            completed++;
+            stats_latency(stats, slot->state == SLOT_WRITING, slot->submitted_ns);
+            stats_depth(stats, -1);
+            if (slot->state == SLOT_READING) reads_in_flight--;
+            if (ret == -1 && err == EAGAIN && mode == ACOPY_COMPLETION_SIGNAL)
+            {
+                // glibc failed the operation because its signal could not be queued; it is safe to run again.
+                uint64_t submit_start = stats_clock(stats);
+                if ((slot->state == SLOT_READING ? aio_read(&aiocb_list[i]) : aio_write(&aiocb_list[i])) == 0)
+                {
+                    slot->submitted_ns = stats_submit(stats, submit_start);
+                    stats_depth(stats, 1);
+                    if (slot->state == SLOT_READING) reads_in_flight++;
+                    ops_in_flight++;
+                    continue;
+                }
+                err = errno;
+            }
+            if (ret == -1 || (ret == 0 && slot->state == SLOT_WRITING))
+            {
+                errno = (ret == -1) ? err : EIO;
+                perror(slot->state == SLOT_READING ? "aio_read" : "aio_write");
+                feeder_done(feeder, block, -1);
+                slot->state = SLOT_DONE;
+                status = -1;
+                continue;
+            }
+
+            int submitted;
+            uint64_t submit_start = stats_clock(stats);
+            if (slot->state == SLOT_READING)
+            {
+                if (ret == 0) block->length = slot->done; // The source shrank: keep what was read.
+                slot->done += ret;
+                if (slot->done < block->length)
+                {
+                    // Short read: resubmit the remainder of the block.
+                    submitted = aio_read_setup(&aiocb_list[i], block->source_fd, block->offset + slot->done, slot->in + slot->done, block->length - slot->done, &slot->notification);
+                    if (submitted == 0) reads_in_flight++;
+                }
+                else if (codec)
+                {
+                    // Transform it on a codec thread; the write is started below once that is done.
+                    codec_push(codec, &slot->transform, slot->in, block->length, slot->out);
+                    slot->state = SLOT_TRANSFORMING;
+                    transforms_in_flight++;
+                    ctx->notifications_owed++;
+                    continue;
+                }
+                else if (ordered)
+                {
+                    // Hash it now; the write waits for its turn below.
+                    if (block->length > 0) hasher_push_block(hashing, &slot->hash, slot->buf, block);
+                    slot->out_length = block->length;
+                    slot->state = SLOT_READ;
+                    continue;
+                }
+                else if (block->length == 0)
+                {
+                    feeder_done(feeder, block, 0);
+                    slot_release(ctx, slot);
+                    continue;
+                }
+                else
+                {
+                    // The whole block is in the buffer: write it out and hash it at the same time.
+                    slot->done = 0;
+                    slot->out_offset = block->offset;
+                    slot->out_length = block->length;
+                    slot->state = SLOT_WRITING;
+                    hasher_push_block(hashing, &slot->hash, slot->buf, block);
+                    submitted = aio_write_setup(&aiocb_list[i], block->destination_fd, block->offset, slot->buf, block->length, &slot->notification);
+                }
+            }
+            else
+            {
+                // Progress counts the source, which is what a codec's output is not.
+                if (!codec) stats_bytes(stats, ret);
+                slot->done += ret;
+                if (slot->done == slot->out_length)
+                {
+                    if (codec) stats_bytes(stats, block->length);
+                    hasher_wait(hashing, &slot->hash);
+                    feeder_done(feeder, block, 0);
+                    slot_release(ctx, slot);
+                    continue;
+                }
+                // Short write: resubmit the remainder of the block.
+                submitted = aio_write_setup(&aiocb_list[i], block->destination_fd, slot->out_offset + slot->done, slot->out + slot->done, slot->out_length - slot->done, &slot->notification);
+            }
+
+            if (submitted == -1)
+            {
+                perror(slot->state == SLOT_READING ? "aio_read" : "aio_write");
+                feeder_done(feeder, block, -1);
+                slot->state = SLOT_DONE;
+                status = -1;
+                continue;
+            }
+            slot->submitted_ns = stats_submit(stats, submit_start);
+            stats_depth(stats, 1);
+            ops_in_flight++;
+            ctx->notifications_owed++;
+        }
+        if (!completed) stats_wait(stats, scan_start);
+
+        // Blocks the codec threads are done with are ready to be written.
+        for (int i = 0; transforms_in_flight > 0 && i < num_slots; i++)
+        {
+            struct copy_slot *slot = &slot_list[i];
+            if (slot->state != SLOT_TRANSFORMING || !codec_finished(codec, &slot->transform)) continue;
+            transforms_in_flight--;
+            if (slot->transform.status == -1)
+            {
+                feeder_done(feeder, &slot->block, -1);
+                slot->state = SLOT_DONE;
+                status = -1;
+                continue;
+            }
+            slot->out_length = slot->transform.output_length;
+            slot->state = SLOT_READ;
+        }
+
+        // Start the writes of the blocks that are read: for ordered writes as long as they come next in order.
+        for (int n = 0; (ordered || codec) && status == 0; n++)
+        {
+            struct copy_slot *slot;
+            if (ordered)
+            {
+                // Every block from next_write on still holds its slot, so the ring cannot have wrapped over it.
+                if (next_write == handed_out) break;
+                slot = &slot_list[ctx->order[next_write % num_slots]];
+                if (slot->state != SLOT_READ) break;
+                next_write++;
+            }
+            else
+            {
+                if (n == num_slots) break;
+                slot = &slot_list[n];
+                if (slot->state != SLOT_READ) continue;
+            }
+            if (slot->out_length == 0)
+            {
+                feeder_done(feeder, &slot->block, 0);
+                slot_release(ctx, slot);
+                continue;
+            }
+            slot->out_offset = codec ? codec_place(codec, &slot->block, slot->out_length) : slot->block.offset;
+            if (slot->out_offset == -1)
+            {
+                feeder_done(feeder, &slot->block, -1);
+                slot->state = SLOT_DONE;
+                status = -1;
+                break;
+            }
+            uint64_t submit_start = stats_clock(stats);
+            slot->done = 0;
+            slot->state = SLOT_WRITING;
+            if (aio_write_setup(&aiocb_list[slot->index], slot->block.destination_fd, slot->out_offset, slot->out, slot->out_length, &slot->notification) == -1)
+            {
+                perror("aio_write");
+                feeder_done(feeder, &slot->block, -1);
+                slot->state = SLOT_DONE;
+                status = -1;
+                break;
+            }
+            slot->submitted_ns = stats_submit(stats, submit_start);
+            stats_depth(stats, 1);
+            ops_in_flight++;
+            ctx->notifications_owed++;
+        }
+    }
+    for (int i = 0; i < num_slots; i++)
+    {
+        // Blocks taken from the feeder but never submitted.
+        if (slot_list[i].retry || slot_list[i].state == SLOT_READ || slot_list[i].state == SLOT_TRANSFORMING) feeder_done(feeder, &slot_list[i].block, -1);
+    }
+    // The codec threads may still be busy with blocks of a failed copy, and they wake the loop through ctx.
+    if (codec) codec_stop(codec);
+    hasher_stop(hashing);
+    completion_teardown(ctx, mode);
+    aio_context_free(ctx);
+    return status;
+}
+
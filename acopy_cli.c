@@ -0,0 +1,634 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "acopy.h"
+
+// Long-only options.
+enum
+{
+    OPT_DIRECT_COMPARE = 256,
+    OPT_STRIPES,
+    OPT_MEMORY_CAP,
+    OPT_PROGRESS,
+    OPT_STATS_JSON,
+    OPT_VERIFY,
+    OPT_MANIFEST,
+    OPT_RESUME,
+    OPT_DURABILITY,
+    OPT_WRITEBEHIND,
+    OPT_NO_PREALLOCATE,
+    OPT_ORDERED_WRITES,
+    OPT_HDD,
+    OPT_READAHEAD,
+    OPT_RATE,
+    OPT_OPS_RATE,
+    OPT_LATENCY_TARGET,
+    OPT_THROTTLE_FILE,
+    OPT_COMPRESS,
+    OPT_LEVEL,
+    OPT_COMPRESS_THREADS,
+    OPT_DECOMPRESS,
+    OPT_MMAP_COPY,
+    OPT_HUGE_PAGES,
+    OPT_AIO_THREADS,
+    OPT_AIO_IDLE
+};
+
+// How often the monitor samples the stats for the moving window and the depth series.
+#define MONITOR_TICK_NS 250000000L
+
+static const struct option long_options[] =
+{
+    {"block-size",     required_argument, NULL, 'b'},
+    {"ops",            required_argument, NULL, 'n'},
+    {"engine",         required_argument, NULL, 'e'},
+    {"completion",     required_argument, NULL, 'c'},
+    {"direct",         no_argument,       NULL, 'd'},
+    {"direct-compare", no_argument,       NULL, OPT_DIRECT_COMPARE},
+    {"threads",        required_argument, NULL, 't'},
+    {"stripes",        no_argument,       NULL, OPT_STRIPES},
+    {"recursive",      no_argument,       NULL, 'r'},
+    {"auto",           no_argument,       NULL, 'a'},
+    {"sparse",         no_argument,       NULL, 'S'},
+    {"memory-cap",     required_argument, NULL, OPT_MEMORY_CAP},
+    {"progress",       optional_argument, NULL, OPT_PROGRESS},
+    {"stats-json",     required_argument, NULL, OPT_STATS_JSON},
+    {"verify",         optional_argument, NULL, OPT_VERIFY},
+    {"manifest",       required_argument, NULL, OPT_MANIFEST},
+    {"resume",         no_argument,       NULL, OPT_RESUME},
+    {"durability",     required_argument, NULL, OPT_DURABILITY},
+    {"writebehind",    required_argument, NULL, OPT_WRITEBEHIND},
+    {"no-preallocate", no_argument,       NULL, OPT_NO_PREALLOCATE},
+    {"ordered-writes", no_argument,       NULL, OPT_ORDERED_WRITES},
+    {"hdd",            required_argument, NULL, OPT_HDD},
+    {"readahead",      required_argument, NULL, OPT_READAHEAD},
+    {"rate",           required_argument, NULL, OPT_RATE},
+    {"ops-rate",       required_argument, NULL, OPT_OPS_RATE},
+    {"latency-target", required_argument, NULL, OPT_LATENCY_TARGET},
+    {"throttle-file",  required_argument, NULL, OPT_THROTTLE_FILE},
+    {"compress",       required_argument, NULL, OPT_COMPRESS},
+    {"level",          required_argument, NULL, OPT_LEVEL},
+    {"compress-threads", required_argument, NULL, OPT_COMPRESS_THREADS},
+    {"decompress",     no_argument,       NULL, OPT_DECOMPRESS},
+    {"mmap-copy",      no_argument,       NULL, OPT_MMAP_COPY},
+    {"huge-pages",     no_argument,       NULL, OPT_HUGE_PAGES},
+    {"aio-threads",    required_argument, NULL, OPT_AIO_THREADS},
+    {"aio-idle",       required_argument, NULL, OPT_AIO_IDLE},
+    {"help",           no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+static void usage(FILE *out, const char *program)
+{
+    fprintf(out,
+            "Usage: %s [OPTION]... SOURCE DESTINATION\n"
+            "Copy SOURCE to DESTINATION with asynchronous I/O. Without paths, they are asked for interactively.\n"
+            "\n"
+            "  -b, --block-size=KB      block size in KB (default 128)\n"
+            "  -n, --ops=N              asynchronous operations in flight, 1-%d (default 12)\n"
+            "  -e, --engine=NAME        posix-aio, io_uring, copy_file_range, sendfile, splice, mmap or auto\n"
+            "  -c, --completion=MODE    spin, suspend, signal or thread (posix-aio only)\n"
+            "  -d, --direct             bypass the page cache with O_DIRECT\n"
+            "      --direct-compare     copy buffered and then direct, and compare the two\n"
+            "  -t, --threads=N          split the file over N pinned worker threads, 1-%d\n"
+            "      --stripes            hand the workers interleaved stripes instead of ranges\n"
+            "  -r, --recursive          copy a directory tree\n"
+            "  -a, --auto               tune block size and operations while copying, cached per device\n"
+            "      --memory-cap=MB      largest buffer pool --auto may grow to (default 64)\n"
+            "  -S, --sparse             copy only the data extents and keep the holes\n"
+            "      --progress[=SECONDS] print throughput, depth and latencies to stderr every SECONDS (default 1)\n"
+            "      --stats-json=FILE    write the final stats and latency histograms as JSON to FILE, - for stdout\n"
+            "                           (SIGUSR1 dumps the same JSON to stderr while copying)\n"
+            "      --verify[=MODE]      CRC32C every block between its read and its write (inline, the default),\n"
+            "                           and with readback read the destination back and compare\n"
+            "      --manifest=FILE      write the block digests to FILE (implies --verify)\n"
+            "      --resume             journal finished blocks in DESTINATION.acopy-journal and skip them on a rerun\n"
+            "      --durability=POLICY  none (the default), end (fdatasync once done), writebehind (flush and drop\n"
+            "                           the page cache every few MB, then fdatasync) or dsync (O_DSYNC writes)\n"
+            "      --writebehind=MB     write-behind window (default 32, implies --durability=writebehind)\n"
+            "      --no-preallocate     do not fallocate the destination before copying\n"
+            "      --ordered-writes     start the writes in file order (posix-aio and io_uring)\n"
+            "      --hdd=MODE           HDD mode: one read at a time in order, ordered writes, read-ahead;\n"
+            "                           auto (the default) turns it on for rotational devices, or on, off\n"
+            "      --readahead=MB       read the source this far ahead of the copy (default 16 in HDD mode)\n"
+            "      --rate=MB            copy at most MB per second\n"
+            "      --ops-rate=N         copy at most N blocks per second\n"
+            "      --latency-target=US  lower the rate while the mean completion latency is above US microseconds\n"
+            "      --throttle-file=FILE read 'MB/s [blocks/s [latency-us]]' (0 for no limit) from FILE whenever it\n"
+            "                           changes or on SIGUSR2\n"
+            "      --compress=CODEC     compress every block into an independent lz4 or zstd frame, with a\n"
+            "                           frame index at the end (posix-aio; liblz4 or libzstd is loaded at run time)\n"
+            "      --level=N            zstd compression level (default 3)\n"
+            "      --compress-threads=N threads compressing or decompressing (default: one per core)\n"
+            "      --decompress         SOURCE was written with --compress: write out the data it holds\n"
+            "      --mmap-copy          mmap engine: map DESTINATION too and copy with streaming stores\n"
+            "      --huge-pages         allocate the buffer pool from huge pages (hugetlb, else transparent)\n"
+            "      --aio-threads=N      glibc AIO helper threads (default: the operations in flight, 20-1024)\n"
+            "      --aio-idle=SECONDS   how long an idle glibc AIO helper thread lingers (default 1)\n"
+            "  -h, --help               show this help\n",
+            program, ACOPY_MAX_IO_OPERATIONS, ACOPY_MAX_THREADS);
+}
+
+// Parse a positive number, -1 if the argument is not one.
+static long parse_number(const char *arg)
+{
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || value < 1) return -1;
+    return value;
+}
+
+// Ask for a value on the terminal, the way the tool worked before it took arguments.
+static void prompt(const char *question, int color)
+{
+    if (color) printf("\033[0;34;40m"); // Blue text color
+    printf("%s", question);
+    if (color) printf("\033[0m"); // Normal text color
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Stats monitor.
+// SIGUSR1 and SIGUSR2 are blocked in every thread and taken by this one with sigtimedwait(), so the
+// engines never see EINTR. Between signals it samples the stats every tick, prints the progress line when
+// it is due, and picks up a changed throttle file.
+// -------------------------------------------------------------------------------------------------------
+struct monitor
+{
+    struct acopy_stats *stats;
+    pthread_t thread;
+    sigset_t signals;
+    long progress_seconds; // 0 for no progress line.
+    int stop;
+    struct acopy_throttle *throttle;
+    const char *throttle_file;  // NULL for none.
+    struct timespec throttle_mtime; // Modification time of the throttle file when it was last read.
+};
+
+// Apply the throttle file if it changed since the last read, or always with force set.
+static void monitor_read_throttle(struct monitor *monitor, int force)
+{
+    struct stat st;
+    double rate, ops_rate = 0, latency_target = 0;
+    if (!monitor->throttle_file || stat(monitor->throttle_file, &st) == -1) return;
+    if (!force && st.st_mtim.tv_sec == monitor->throttle_mtime.tv_sec && st.st_mtim.tv_nsec == monitor->throttle_mtime.tv_nsec) return;
+    monitor->throttle_mtime = st.st_mtim;
+    FILE *file = fopen(monitor->throttle_file, "r");
+    if (!file) return;
+    int fields = fscanf(file, "%lf %lf %lf", &rate, &ops_rate, &latency_target);
+    fclose(file);
+    if (fields < 1 || rate < 0 || ops_rate < 0 || latency_target < 0)
+    {
+        fprintf(stderr, "%s: expected 'MB/s [blocks/s [latency-us]]'\n", monitor->throttle_file);
+        return;
+    }
+    acopy_throttle_set(monitor->throttle, (uint64_t)(rate * 1024 * 1024), (uint64_t)ops_rate);
+    acopy_throttle_set_target(monitor->throttle, (uint64_t)latency_target);
+    acopy_throttle_print(stderr, monitor->throttle);
+}
+
+static void *monitor_main(void *arg)
+{
+    struct monitor *monitor = arg;
+    struct timespec tick = {0, MONITOR_TICK_NS};
+    struct timespec now, next_progress;
+
+    clock_gettime(CLOCK_MONOTONIC, &next_progress);
+    next_progress.tv_sec += monitor->progress_seconds;
+    for (;;)
+    {
+        int signo = sigtimedwait(&monitor->signals, NULL, &tick);
+        if (__atomic_load_n(&monitor->stop, __ATOMIC_ACQUIRE)) break;
+        acopy_stats_sample(monitor->stats);
+        if (signo == SIGUSR1) acopy_stats_print_json(stderr, monitor->stats);
+        monitor_read_throttle(monitor, signo == SIGUSR2);
+        if (monitor->progress_seconds == 0) continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next_progress.tv_sec || (now.tv_sec == next_progress.tv_sec && now.tv_nsec >= next_progress.tv_nsec))
+        {
+            acopy_stats_print_progress(stderr, monitor->stats);
+            next_progress.tv_sec += monitor->progress_seconds;
+        }
+    }
+    return NULL;
+}
+
+// Block SIGUSR1 and SIGUSR2 before any engine thread exists, so all of them inherit the mask. The monitor itself starts
+// with every signal blocked: the completion signal of the posix-aio engine is process-directed and must
+// only be taken by the engine thread waiting for it.
+static int monitor_start(struct monitor *monitor)
+{
+    sigset_t all, old;
+    sigfillset(&all);
+    sigemptyset(&monitor->signals);
+    sigaddset(&monitor->signals, SIGUSR1);
+    sigaddset(&monitor->signals, SIGUSR2);
+    errno = pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (errno == 0)
+    {
+        errno = pthread_create(&monitor->thread, NULL, monitor_main, monitor);
+        sigaddset(&old, SIGUSR1);
+        sigaddset(&old, SIGUSR2);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    if (errno != 0)
+    {
+        perror("monitor");
+        return -1;
+    }
+    return 0;
+}
+
+// The wake-up signal is queued for the monitor thread itself and never reaches the rest of the process.
+static void monitor_stop(struct monitor *monitor)
+{
+    __atomic_store_n(&monitor->stop, 1, __ATOMIC_RELEASE);
+    pthread_kill(monitor->thread, SIGUSR1);
+    pthread_join(monitor->thread, NULL);
+    acopy_stats_sample(monitor->stats);
+}
+
+// Final summary for --stats-json.
+static int write_stats_json(const char *path, struct acopy_stats *stats)
+{
+    FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!out)
+    {
+        perror(path);
+        return -1;
+    }
+    acopy_stats_print_json(out, stats);
+    if (out != stdout && fclose(out) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Command line front end.
+// -------------------------------------------------------------------------------------------------------
+int acopy_main(int argc, char *argv[], enum acopy_completion default_completion)
+{
+    char source_path[PATH_MAX];
+    char destination_path[PATH_MAX];
+    struct acopy_opts opts;
+    struct acopy_report report;
+    struct acopy_ctx *ctx;
+    struct monitor monitor;
+    const char *stats_json = NULL;
+    uint64_t rate = 0, ops_rate = 0, latency_target = 0;
+    int compare = 0;
+    int recursive = 0;
+    int status;
+    int opt;
+    long value;
+
+    acopy_opts_init(&opts);
+    opts.completion = default_completion;
+    memset(&monitor, 0, sizeof(monitor));
+
+    // Parse command line options.
+    // -------------------------------------------------------------------------------------------------------
+    while ((opt = getopt_long(argc, argv, "b:n:e:c:dt:raSh", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            if ((value = parse_number(optarg)) == -1)
+            {
+                fprintf(stderr, "Invalid block size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.block_size = (size_t)value * 1024; // Convert the block size from KB to bytes.
+            break;
+        case 'n':
+            if ((value = parse_number(optarg)) == -1 || value > ACOPY_MAX_IO_OPERATIONS)
+            {
+                fprintf(stderr, "The number of asynchronous operations must be between 1 and %d\n", ACOPY_MAX_IO_OPERATIONS);
+                return EXIT_FAILURE;
+            }
+            opts.num_async_ops = value;
+            break;
+        case 'e':
+            if (acopy_engine_parse(optarg, &opts.engine) == -1)
+            {
+                fprintf(stderr, "Unknown engine: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            if (acopy_completion_parse(optarg, &opts.completion) == -1)
+            {
+                fprintf(stderr, "Unknown completion mode: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            opts.direct = 1;
+            break;
+        case OPT_DIRECT_COMPARE:
+            compare = 1;
+            break;
+        case 't':
+            if ((value = parse_number(optarg)) == -1 || value > ACOPY_MAX_THREADS)
+            {
+                fprintf(stderr, "The number of threads must be between 1 and %d\n", ACOPY_MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+            opts.threads = value;
+            break;
+        case OPT_STRIPES:
+            opts.stripes = 1;
+            break;
+        case 'r':
+            recursive = 1;
+            break;
+        case 'a':
+            opts.auto_tune = 1;
+            break;
+        case 'S':
+            opts.sparse = 1;
+            break;
+        case OPT_MEMORY_CAP:
+            if ((value = parse_number(optarg)) == -1)
+            {
+                fprintf(stderr, "Invalid memory cap: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.memory_cap = (size_t)value * 1024 * 1024;
+            break;
+        case OPT_PROGRESS:
+            monitor.progress_seconds = 1;
+            if (optarg && (monitor.progress_seconds = parse_number(optarg)) == -1)
+            {
+                fprintf(stderr, "Invalid progress interval: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_STATS_JSON:
+            stats_json = optarg;
+            break;
+        case OPT_VERIFY:
+            if (!optarg || strcmp(optarg, "inline") == 0) opts.verify = ACOPY_VERIFY_INLINE;
+            else if (strcmp(optarg, "readback") == 0) opts.verify = ACOPY_VERIFY_READBACK;
+            else
+            {
+                fprintf(stderr, "Unknown verification mode: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_MANIFEST:
+            opts.manifest = optarg;
+            break;
+        case OPT_RESUME:
+            opts.resume = 1;
+            break;
+        case OPT_DURABILITY:
+            if (acopy_durability_parse(optarg, &opts.durability) == -1)
+            {
+                fprintf(stderr, "Unknown durability policy: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_WRITEBEHIND:
+            if ((value = parse_number(optarg)) == -1)
+            {
+                fprintf(stderr, "Invalid write-behind window: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.writebehind_bytes = (off_t)value * 1024 * 1024;
+            opts.durability = ACOPY_DURABILITY_WRITEBEHIND;
+            break;
+        case OPT_NO_PREALLOCATE:
+            opts.preallocate = 0;
+            break;
+        case OPT_ORDERED_WRITES:
+            opts.ordered_writes = 1;
+            break;
+        case OPT_HDD:
+            if (strcmp(optarg, "auto") == 0) opts.hdd = ACOPY_HDD_AUTO;
+            else if (strcmp(optarg, "on") == 0) opts.hdd = ACOPY_HDD_ON;
+            else if (strcmp(optarg, "off") == 0) opts.hdd = ACOPY_HDD_OFF;
+            else
+            {
+                fprintf(stderr, "Unknown HDD mode: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_READAHEAD:
+            if ((value = parse_number(optarg)) == -1)
+            {
+                fprintf(stderr, "Invalid read-ahead distance: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.readahead_bytes = (off_t)value * 1024 * 1024;
+            break;
+        case OPT_RATE:
+            if ((value = parse_number(optarg)) == -1)
+            {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            rate = (uint64_t)value * 1024 * 1024;
+            break;
+        case OPT_OPS_RATE:
+            if ((value = parse_number(optarg)) == -1)
+            {
+                fprintf(stderr, "Invalid operation rate: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            ops_rate = value;
+            break;
+        case OPT_LATENCY_TARGET:
+            if ((value = parse_number(optarg)) == -1)
+            {
+                fprintf(stderr, "Invalid latency target: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            latency_target = value;
+            break;
+        case OPT_THROTTLE_FILE:
+            monitor.throttle_file = optarg;
+            break;
+        case OPT_COMPRESS:
+            if (acopy_codec_parse(optarg, &opts.compress) == -1 || opts.compress == ACOPY_CODEC_NONE)
+            {
+                fprintf(stderr, "Unknown codec: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_LEVEL:
+            if ((value = parse_number(optarg)) == -1)
+            {
+                fprintf(stderr, "Invalid compression level: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.compress_level = value;
+            break;
+        case OPT_COMPRESS_THREADS:
+            if ((value = parse_number(optarg)) == -1)
+            {
+                fprintf(stderr, "Invalid number of compression threads: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.compress_threads = value;
+            break;
+        case OPT_DECOMPRESS:
+            opts.decompress = 1;
+            break;
+        case OPT_MMAP_COPY:
+            opts.mmap_copy = 1;
+            break;
+        case OPT_HUGE_PAGES:
+            opts.huge_pages = 1;
+            break;
+        case OPT_AIO_THREADS:
+            if ((value = parse_number(optarg)) == -1 || value > ACOPY_MAX_IO_OPERATIONS)
+            {
+                fprintf(stderr, "The number of AIO threads must be between 1 and %d\n", ACOPY_MAX_IO_OPERATIONS);
+                return EXIT_FAILURE;
+            }
+            opts.aio_threads = value;
+            break;
+        case OPT_AIO_IDLE:
+            if ((value = parse_number(optarg)) == -1 || value > INT_MAX)
+            {
+                fprintf(stderr, "Invalid AIO idle time: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.aio_idle_time = value;
+            break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return 0;
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opts.manifest && opts.verify == ACOPY_VERIFY_NONE) opts.verify = ACOPY_VERIFY_INLINE;
+    if (acopy_opts_check(&opts) == -1) return EXIT_FAILURE;
+
+    if (argc - optind == 2)
+    {
+        snprintf(source_path, sizeof(source_path), "%s", argv[optind]);
+        snprintf(destination_path, sizeof(destination_path), "%s", argv[optind + 1]);
+    }
+    else if (argc - optind == 0)
+    {
+        // No paths given: fall back to the interactive prompts, in color only on a terminal.
+        int color = isatty(STDOUT_FILENO);
+        size_t block_size;
+
+        // Title
+        // -------------------------------------------------------------------------------------------------------
+        if (color) printf("\033[0;33;40m"); // Yellow console text color
+        puts("====================================================");
+        puts(" Linux Async Copying ");
+        puts("====================================================");
+        if (color) printf("\033[0m"); // Normal text color
+
+        // Prompt the user for the source and destination file paths, block size, and number of async operations.
+        // -------------------------------------------------------------------------------------------------------
+        prompt("Enter the source file path: ", color);
+        if (scanf("%4095s", source_path) != 1) return EXIT_FAILURE;
+        prompt("Enter the destination file path: ", color);
+        if (scanf("%4095s", destination_path) != 1) return EXIT_FAILURE;
+        prompt("Enter the block size in KB for copying: ", color);
+        if (scanf("%zu", &block_size) != 1) return EXIT_FAILURE;
+        opts.block_size = block_size * 1024; // Convert the block size from KB to bytes.
+        prompt("Enter the number of asynchronous operations: ", color);
+        if (scanf("%d", &opts.num_async_ops) != 1) return EXIT_FAILURE;
+        if (acopy_opts_check(&opts) == -1) return EXIT_FAILURE;
+    }
+    else
+    {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ctx = acopy_ctx_new();
+    if (!ctx) return EXIT_FAILURE;
+    if (rate || ops_rate || latency_target || monitor.throttle_file)
+    {
+        // The throttle file, when it exists, overrides the limits given on the command line.
+        monitor.throttle = opts.throttle = acopy_throttle_new();
+        if (!opts.throttle)
+        {
+            acopy_ctx_free(ctx);
+            return EXIT_FAILURE;
+        }
+        acopy_throttle_set(opts.throttle, rate, ops_rate);
+        acopy_throttle_set_target(opts.throttle, latency_target);
+        monitor_read_throttle(&monitor, 1);
+    }
+    // The stats only cost a few relaxed atomics per operation, so they are always on.
+    monitor.stats = opts.stats = acopy_stats_new();
+    if (!opts.stats || monitor_start(&monitor) == -1)
+    {
+        acopy_throttle_free(opts.throttle);
+        acopy_stats_free(opts.stats);
+        acopy_ctx_free(ctx);
+        return EXIT_FAILURE;
+    }
+
+    if (compare)
+    {
+        // Copy the same file buffered and then direct, both starting from a cold page cache.
+        struct acopy_report buffered_report;
+        opts.direct = 0;
+        acopy_drop_cache(source_path);
+        status = acopy_file(ctx, source_path, destination_path, &opts, &buffered_report);
+        if (status == 0)
+        {
+            acopy_print_report(stdout, &opts, &buffered_report);
+            opts.direct = 1;
+            acopy_drop_cache(source_path);
+            acopy_drop_cache(destination_path);
+            status = acopy_file(ctx, source_path, destination_path, &opts, &report);
+        }
+        if (status == 0)
+        {
+            acopy_print_report(stdout, &opts, &report);
+            printf("\nDirect vs buffered: %+.1f%% throughput (%.3f s vs %.3f s)\n",
+                   report.elapsed > 0 && buffered_report.elapsed > 0 ? 100.0 * (buffered_report.elapsed / report.elapsed - 1.0) : 0.0,
+                   report.elapsed, buffered_report.elapsed);
+        }
+        acopy_ctx_free(ctx);
+        monitor_stop(&monitor);
+        if (stats_json && write_stats_json(stats_json, opts.stats) == -1) status = -1;
+        acopy_stats_free(opts.stats);
+        acopy_throttle_free(opts.throttle);
+        return status == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    status = recursive ? acopy_tree(ctx, source_path, destination_path, &opts, &report)
+                       : acopy_file(ctx, source_path, destination_path, &opts, &report);
+    acopy_ctx_free(ctx);
+    monitor_stop(&monitor);
+    // The summary is written for failed copies too; it shows where they stalled.
+    if (stats_json && write_stats_json(stats_json, opts.stats) == -1) status = -1;
+    acopy_stats_free(opts.stats);
+    if (status == -1)
+    {
+        // A tree copy goes on past entries it cannot copy, so show how far it got.
+        if (recursive) acopy_print_report(stdout, &opts, &report);
+        fprintf(stderr, "\nCopying failed after %f seconds\n", report.elapsed);
+        acopy_throttle_free(opts.throttle);
+        return EXIT_FAILURE;
+    }
+    acopy_print_report(stdout, &opts, &report);
+    acopy_throttle_free(opts.throttle);
+
+    return 0;
+}
@@ -0,0 +1,667 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include "acopy_internal.h"
+
+// First bytes of a frame of each codec.
+#define ZSTD_FRAME_MAGIC 0xFD2FB528u
+#define LZ4_FRAME_MAGIC 0x184D2204u
+// LZ4F_VERSION of lz4.h.
+#define LZ4F_API_VERSION 100
+
+// Frame index: the seek table of the zstd seekable format. It is a skippable frame, so zstd and lz4
+// decoders pass over it, holding the compressed and original size of every frame, and a footer that
+// finds it from the end of the file.
+#define SKIPPABLE_MAGIC 0x184D2A5Eu
+#define SEEKABLE_MAGIC 0x8F92EAB1u
+#define SKIPPABLE_HEADER_SIZE 8
+#define SEEK_FOOTER_SIZE 9
+#define SEEK_CHECKSUM_FLAG 0x80 // Entries carry a checksum of their frame, which this reader skips.
+#define SEEK_RESERVED_BITS 0x7C
+
+// -------------------------------------------------------------------------------------------------------
+// Codec libraries.
+// Neither liblz4 nor libzstd is needed to build; the one a copy uses is loaded when the copy starts and
+// stays loaded. Only the stable frame functions are used, declared here as the libraries export them.
+// -------------------------------------------------------------------------------------------------------
+struct codec_library
+{
+    const char *file;
+    void *handle;
+    // libzstd
+    size_t (*ZSTD_compressBound)(size_t size);
+    void *(*ZSTD_createCCtx)(void);
+    size_t (*ZSTD_freeCCtx)(void *cctx);
+    size_t (*ZSTD_compressCCtx)(void *cctx, void *dst, size_t capacity, const void *src, size_t size, int level);
+    void *(*ZSTD_createDCtx)(void);
+    size_t (*ZSTD_freeDCtx)(void *dctx);
+    size_t (*ZSTD_decompressDCtx)(void *dctx, void *dst, size_t capacity, const void *src, size_t size);
+    unsigned (*ZSTD_isError)(size_t code);
+    const char *(*ZSTD_getErrorName)(size_t code);
+    // liblz4, with default preferences
+    size_t (*LZ4F_compressFrameBound)(size_t size, const void *preferences);
+    size_t (*LZ4F_compressFrame)(void *dst, size_t capacity, const void *src, size_t size, const void *preferences);
+    size_t (*LZ4F_createDecompressionContext)(void **dctx, unsigned version);
+    size_t (*LZ4F_freeDecompressionContext)(void *dctx);
+    size_t (*LZ4F_decompress)(void *dctx, void *dst, size_t *dst_size, const void *src, size_t *src_size, const void *options);
+    unsigned (*LZ4F_isError)(size_t code);
+    const char *(*LZ4F_getErrorName)(size_t code);
+};
+
+static struct codec_library libraries[] =
+{
+    [ACOPY_CODEC_LZ4] = {.file = "liblz4.so.1"},
+    [ACOPY_CODEC_ZSTD] = {.file = "libzstd.so.1"},
+};
+static pthread_mutex_t libraries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define LOAD_SYMBOL(library, handle, name, missing) \
+    if (!(*(void **)&(library)->name = dlsym(handle, #name)) && !(missing)) missing = #name
+
+static const struct codec_library *codec_library_load(enum acopy_codec codec)
+{
+    struct codec_library *library = &libraries[codec];
+    pthread_mutex_lock(&libraries_lock);
+    if (!library->handle)
+    {
+        const char *missing = NULL;
+        void *handle = dlopen(library->file, RTLD_NOW | RTLD_LOCAL);
+        if (!handle)
+        {
+            fprintf(stderr, "%s compression needs %s: %s\n", acopy_codec_name(codec), library->file, dlerror());
+        }
+        else if (codec == ACOPY_CODEC_ZSTD)
+        {
+            LOAD_SYMBOL(library, handle, ZSTD_compressBound, missing);
+            LOAD_SYMBOL(library, handle, ZSTD_createCCtx, missing);
+            LOAD_SYMBOL(library, handle, ZSTD_freeCCtx, missing);
+            LOAD_SYMBOL(library, handle, ZSTD_compressCCtx, missing);
+            LOAD_SYMBOL(library, handle, ZSTD_createDCtx, missing);
+            LOAD_SYMBOL(library, handle, ZSTD_freeDCtx, missing);
+            LOAD_SYMBOL(library, handle, ZSTD_decompressDCtx, missing);
+            LOAD_SYMBOL(library, handle, ZSTD_isError, missing);
+            LOAD_SYMBOL(library, handle, ZSTD_getErrorName, missing);
+        }
+        else
+        {
+            LOAD_SYMBOL(library, handle, LZ4F_compressFrameBound, missing);
+            LOAD_SYMBOL(library, handle, LZ4F_compressFrame, missing);
+            LOAD_SYMBOL(library, handle, LZ4F_createDecompressionContext, missing);
+            LOAD_SYMBOL(library, handle, LZ4F_freeDecompressionContext, missing);
+            LOAD_SYMBOL(library, handle, LZ4F_decompress, missing);
+            LOAD_SYMBOL(library, handle, LZ4F_isError, missing);
+            LOAD_SYMBOL(library, handle, LZ4F_getErrorName, missing);
+        }
+        if (handle && missing)
+        {
+            fprintf(stderr, "%s has no %s\n", library->file, missing);
+            dlclose(handle);
+        }
+        else if (handle)
+        {
+            library->handle = handle;
+        }
+    }
+    pthread_mutex_unlock(&libraries_lock);
+    return library->handle ? library : NULL;
+}
+
+// Largest frame a block of size bytes can compress into.
+static size_t codec_bound(const struct block_codec *codec, size_t size)
+{
+    if (codec->codec == ACOPY_CODEC_ZSTD) return codec->library->ZSTD_compressBound(size);
+    return codec->library->LZ4F_compressFrameBound(size, NULL);
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Transforms, run on the codec threads. Each thread keeps its own library context.
+// -------------------------------------------------------------------------------------------------------
+static void *codec_context_new(const struct block_codec *codec)
+{
+    void *context = NULL;
+    if (codec->codec == ACOPY_CODEC_ZSTD) context = codec->compress ? codec->library->ZSTD_createCCtx() : codec->library->ZSTD_createDCtx();
+    else if (codec->codec == ACOPY_CODEC_LZ4 && !codec->compress &&
+             codec->library->LZ4F_isError(codec->library->LZ4F_createDecompressionContext(&context, LZ4F_API_VERSION))) context = NULL;
+    return context;
+}
+
+static void codec_context_free(const struct block_codec *codec, void *context)
+{
+    if (!context) return;
+    if (codec->codec == ACOPY_CODEC_ZSTD && codec->compress) codec->library->ZSTD_freeCCtx(context);
+    else if (codec->codec == ACOPY_CODEC_ZSTD) codec->library->ZSTD_freeDCtx(context);
+    else codec->library->LZ4F_freeDecompressionContext(context);
+}
+
+static int codec_compress(const struct block_codec *codec, void *context, struct codec_job *job)
+{
+    const struct codec_library *library = codec->library;
+    size_t ret;
+    if (codec->codec == ACOPY_CODEC_ZSTD)
+    {
+        if (!context)
+        {
+            fprintf(stderr, "zstd: no compression context\n");
+            return -1;
+        }
+        ret = library->ZSTD_compressCCtx(context, job->output, codec->frame_size, job->input, job->input_length, codec->level);
+        if (library->ZSTD_isError(ret))
+        {
+            fprintf(stderr, "zstd: %s\n", library->ZSTD_getErrorName(ret));
+            return -1;
+        }
+    }
+    else
+    {
+        ret = library->LZ4F_compressFrame(job->output, codec->frame_size, job->input, job->input_length, NULL);
+        if (library->LZ4F_isError(ret))
+        {
+            fprintf(stderr, "lz4: %s\n", library->LZ4F_getErrorName(ret));
+            return -1;
+        }
+    }
+    job->output_length = ret;
+    return 0;
+}
+
+static int codec_decompress(const struct block_codec *codec, void *context, struct codec_job *job)
+{
+    const struct codec_library *library = codec->library;
+    if (!context)
+    {
+        fprintf(stderr, "%s: no decompression context\n", acopy_codec_name(codec->codec));
+        return -1;
+    }
+    if (codec->codec == ACOPY_CODEC_ZSTD)
+    {
+        size_t ret = library->ZSTD_decompressDCtx(context, job->output, codec->block_size, job->input, job->input_length);
+        if (library->ZSTD_isError(ret))
+        {
+            fprintf(stderr, "zstd: %s\n", library->ZSTD_getErrorName(ret));
+            return -1;
+        }
+        job->output_length = ret;
+        return 0;
+    }
+    // An lz4 frame is decoded in steps until the decoder says the frame is complete.
+    size_t consumed = 0, produced = 0, hint = 1;
+    while (hint != 0 && consumed < job->input_length)
+    {
+        size_t src_size = job->input_length - consumed;
+        size_t dst_size = codec->block_size - produced;
+        hint = library->LZ4F_decompress(context, job->output + produced, &dst_size, job->input + consumed, &src_size, NULL);
+        if (library->LZ4F_isError(hint))
+        {
+            fprintf(stderr, "lz4: %s\n", library->LZ4F_getErrorName(hint));
+            return -1;
+        }
+        consumed += src_size;
+        produced += dst_size;
+        if (src_size == 0 && dst_size == 0) break; // The block is full.
+    }
+    if (hint != 0 || consumed != job->input_length)
+    {
+        fprintf(stderr, "lz4: the frame does not match its index entry\n");
+        return -1;
+    }
+    job->output_length = produced;
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Codec threads.
+// Like the hashing thread, but a pool: the engine loop queues a block as soon as it is read and goes on
+// submitting, and writes it once its job is done. Every slot has at most one job queued.
+// -------------------------------------------------------------------------------------------------------
+static void *codec_main(void *arg)
+{
+    struct block_codec *codec = arg;
+    void *context = codec_context_new(codec);
+    pthread_mutex_lock(&codec->lock);
+    for (;;)
+    {
+        while (codec->count == 0 && !codec->stop) pthread_cond_wait(&codec->work, &codec->lock);
+        if (codec->count == 0) break; // Stopped, and everything queued is done.
+        struct codec_job *job = codec->queue[codec->head];
+        codec->head = (codec->head + 1) % CODEC_QUEUE;
+        codec->count--;
+        pthread_mutex_unlock(&codec->lock);
+
+        int status = codec->compress ? codec_compress(codec, context, job) : codec_decompress(codec, context, job);
+
+        pthread_mutex_lock(&codec->lock);
+        job->status = status;
+        job->pending = 0;
+        codec->unseen++;
+        pthread_cond_broadcast(&codec->finished);
+        pthread_mutex_unlock(&codec->lock);
+        if (codec->wake) codec->wake(codec->wake_arg);
+        pthread_mutex_lock(&codec->lock);
+    }
+    pthread_mutex_unlock(&codec->lock);
+    codec_context_free(codec, context);
+    return NULL;
+}
+
+// Frame buffers for num_slots engine slots, and the threads. They start with every signal blocked, so they
+// never take the posix-aio completion signal. wake is called from a codec thread for every finished job.
+int codec_start(struct block_codec *codec, int num_slots, void (*wake)(void *arg), void *wake_arg)
+{
+    sigset_t all, old;
+    codec->frames = malloc(num_slots * codec->frame_size);
+    if (!codec->frames)
+    {
+        perror("malloc");
+        return -1;
+    }
+    codec->head = codec->count = codec->stop = codec->unseen = 0;
+    codec->started = 0;
+    codec->wake = wake;
+    codec->wake_arg = wake_arg;
+    pthread_mutex_init(&codec->lock, NULL);
+    pthread_cond_init(&codec->work, NULL);
+    pthread_cond_init(&codec->finished, NULL);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < codec->num_threads; i++)
+    {
+        errno = pthread_create(&codec->threads[i], NULL, codec_main, codec);
+        if (errno != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+        codec->started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (codec->started < codec->num_threads)
+    {
+        codec_stop(codec);
+        return -1;
+    }
+    return 0;
+}
+
+// Finish everything queued and join the threads.
+void codec_stop(struct block_codec *codec)
+{
+    pthread_mutex_lock(&codec->lock);
+    codec->stop = 1;
+    pthread_cond_broadcast(&codec->work);
+    pthread_mutex_unlock(&codec->lock);
+    for (int i = 0; i < codec->started; i++) pthread_join(codec->threads[i], NULL);
+    codec->started = 0;
+    pthread_mutex_destroy(&codec->lock);
+    pthread_cond_destroy(&codec->work);
+    pthread_cond_destroy(&codec->finished);
+    free(codec->frames);
+    codec->frames = NULL;
+}
+
+// Where an engine slot reads into and writes from. Compressing, the block is read into the slot's own
+// buffer and its frame written from the slot's frame buffer; decompressing, the other way round.
+void codec_buffers(struct block_codec *codec, int slot, char *block_buffer, char **input, char **output)
+{
+    char *frame = codec->frames + slot * codec->frame_size;
+    *input = codec->compress ? block_buffer : frame;
+    *output = codec->compress ? frame : block_buffer;
+}
+
+void codec_push(struct block_codec *codec, struct codec_job *job, const char *input, size_t length, char *output)
+{
+    job->input = input;
+    job->input_length = length;
+    job->output = output;
+    job->output_length = 0;
+    job->status = 0;
+    job->pending = 1;
+    pthread_mutex_lock(&codec->lock);
+    codec->queue[(codec->head + codec->count) % CODEC_QUEUE] = job;
+    codec->count++;
+    pthread_cond_signal(&codec->work);
+    pthread_mutex_unlock(&codec->lock);
+}
+
+int codec_finished(struct block_codec *codec, struct codec_job *job)
+{
+    pthread_mutex_lock(&codec->lock);
+    int finished = !job->pending;
+    pthread_mutex_unlock(&codec->lock);
+    return finished;
+}
+
+// Block until a job finishes that the engine loop has not seen yet.
+void codec_wait(struct block_codec *codec)
+{
+    pthread_mutex_lock(&codec->lock);
+    while (codec->unseen == 0) pthread_cond_wait(&codec->finished, &codec->lock);
+    codec->unseen = 0;
+    pthread_mutex_unlock(&codec->lock);
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Output offsets.
+// A compressed block is written where the frames before it end, so the engine loop places the frames in
+// file order (an ordered feeder), and they are recorded in the index as they are placed. The writes still
+// complete in any order. A decompressed block goes where its index entry says.
+// -------------------------------------------------------------------------------------------------------
+off_t codec_place(struct block_codec *codec, const struct copy_block *block, size_t length)
+{
+    struct frame_index *index = &codec->index;
+    if (!codec->compress)
+    {
+        const struct frame_entry *entry = block->owner;
+        if (length != entry->original_length)
+        {
+            fprintf(stderr, "The frame at %lld holds %zu bytes, its index entry says %zu\n", (long long)entry->offset, length, entry->original_length);
+            return -1;
+        }
+        return entry->original_offset;
+    }
+    if (index->count == index->capacity)
+    {
+        long capacity = index->capacity ? 2 * index->capacity : 64;
+        struct frame_entry *entries = realloc(index->entries, capacity * sizeof(struct frame_entry));
+        if (!entries)
+        {
+            perror("realloc");
+            return -1;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    struct frame_entry *entry = &index->entries[index->count++];
+    entry->offset = codec->output_end;
+    entry->length = length;
+    entry->original_offset = block->offset;
+    entry->original_length = block->length;
+    codec->output_end += length;
+    return entry->offset;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Frame index on disk: little-endian, one (frame length, original length) pair per frame.
+// -------------------------------------------------------------------------------------------------------
+static void put_le32(unsigned char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int pread_full(int fd, void *buffer, size_t size, off_t offset)
+{
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t ret = pread(fd, (char *)buffer + done, size - done, offset + done);
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret == -1) return -1;
+        if (ret == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static int index_write(const struct frame_index *index, int fd, off_t offset, off_t *end)
+{
+    size_t table = index->count * 8 + SEEK_FOOTER_SIZE;
+    size_t size = SKIPPABLE_HEADER_SIZE + table;
+    if (index->count > UINT32_MAX || table > UINT32_MAX)
+    {
+        fprintf(stderr, "Too many frames for the frame index\n");
+        return -1;
+    }
+    unsigned char *frame = malloc(size), *p = frame;
+    if (!frame)
+    {
+        perror("malloc");
+        return -1;
+    }
+    put_le32(p, SKIPPABLE_MAGIC);
+    put_le32(p + 4, table);
+    p += SKIPPABLE_HEADER_SIZE;
+    for (long i = 0; i < index->count; i++, p += 8)
+    {
+        put_le32(p, index->entries[i].length);
+        put_le32(p + 4, index->entries[i].original_length);
+    }
+    put_le32(p, index->count);
+    p[4] = 0; // No checksums.
+    put_le32(p + 5, SEEKABLE_MAGIC);
+
+    for (size_t written = 0; written < size;)
+    {
+        ssize_t ret = pwrite(fd, frame + written, size - written, offset + written);
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret == -1)
+        {
+            perror("pwrite frame index");
+            free(frame);
+            return -1;
+        }
+        written += ret;
+    }
+    free(frame);
+    *end = offset + size;
+    return 0;
+}
+
+static int index_read(struct frame_index *index, int fd, off_t size)
+{
+    unsigned char footer[SEEK_FOOTER_SIZE], header[SKIPPABLE_HEADER_SIZE];
+    if (size < SKIPPABLE_HEADER_SIZE + SEEK_FOOTER_SIZE || pread_full(fd, footer, sizeof(footer), size - SEEK_FOOTER_SIZE) == -1 ||
+        get_le32(footer + 5) != SEEKABLE_MAGIC)
+    {
+        fprintf(stderr, "The source does not end with a frame index; it was not written by a compressed copy\n");
+        return -1;
+    }
+    long count = get_le32(footer);
+    if (footer[4] & SEEK_RESERVED_BITS)
+    {
+        fprintf(stderr, "The frame index uses features this version does not know\n");
+        return -1;
+    }
+    size_t entry_size = (footer[4] & SEEK_CHECKSUM_FLAG) ? 12 : 8;
+    off_t table = (off_t)count * entry_size + SEEK_FOOTER_SIZE;
+    off_t start = size - table - SKIPPABLE_HEADER_SIZE;
+    if (start < 0 || pread_full(fd, header, sizeof(header), start) == -1 || get_le32(header) != SKIPPABLE_MAGIC || get_le32(header + 4) != table)
+    {
+        fprintf(stderr, "The frame index at the end of the source is damaged\n");
+        return -1;
+    }
+
+    unsigned char *entries = malloc(table - SEEK_FOOTER_SIZE + 1);
+    index->entries = calloc(count ? count : 1, sizeof(struct frame_entry));
+    if (!entries || !index->entries)
+    {
+        perror("malloc");
+        free(entries);
+        return -1;
+    }
+    index->count = index->capacity = count;
+    if (pread_full(fd, entries, table - SEEK_FOOTER_SIZE, start + SKIPPABLE_HEADER_SIZE) == -1)
+    {
+        perror("pread frame index");
+        free(entries);
+        return -1;
+    }
+    off_t offset = 0, original_offset = 0;
+    for (long i = 0; i < count; i++)
+    {
+        struct frame_entry *entry = &index->entries[i];
+        entry->offset = offset;
+        entry->length = get_le32(entries + i * entry_size);
+        entry->original_offset = original_offset;
+        entry->original_length = get_le32(entries + i * entry_size + 4);
+        offset += entry->length;
+        original_offset += entry->original_length;
+    }
+    free(entries);
+    if (offset != start)
+    {
+        fprintf(stderr, "The frame index does not match the frames in the source\n");
+        return -1;
+    }
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Set up a compressed copy of source_size bytes, or a decompressing copy of a file of that size.
+// Decompressing, the frame index decides the codec, the block size and the size of the destination.
+// -------------------------------------------------------------------------------------------------------
+int codec_open(struct block_codec *codec, int source_fd, off_t source_size, struct acopy_opts *opts, off_t *destination_size)
+{
+    memset(codec, 0, sizeof(*codec));
+    codec->compress = !opts->decompress;
+    codec->level = opts->compress_level;
+    codec->num_threads = (opts->compress_threads > 0) ? opts->compress_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (codec->num_threads < 1) codec->num_threads = 1;
+    if (codec->num_threads > ACOPY_MAX_THREADS) codec->num_threads = ACOPY_MAX_THREADS;
+
+    if (codec->compress)
+    {
+        codec->codec = opts->compress;
+        codec->library = codec_library_load(codec->codec);
+        if (!codec->library) return -1;
+        codec->block_size = opts->block_size;
+        codec->frame_size = codec_bound(codec, opts->block_size);
+        codec->index.capacity = (source_size + opts->block_size - 1) / opts->block_size;
+        codec->index.entries = malloc((codec->index.capacity ? codec->index.capacity : 1) * sizeof(struct frame_entry));
+        if (!codec->index.entries)
+        {
+            perror("malloc");
+            return -1;
+        }
+        *destination_size = 0; // Known once the frames are written.
+        return 0;
+    }
+
+    if (index_read(&codec->index, source_fd, source_size) == -1)
+    {
+        codec_close(codec);
+        return -1;
+    }
+    codec->frame_size = 1;
+    for (long i = 0; i < codec->index.count; i++)
+    {
+        const struct frame_entry *entry = &codec->index.entries[i];
+        if (entry->original_length > codec->block_size) codec->block_size = entry->original_length;
+        if (entry->length > codec->frame_size) codec->frame_size = entry->length;
+    }
+    if (codec->index.count > 0)
+    {
+        unsigned char magic[4];
+        if (pread_full(source_fd, magic, sizeof(magic), 0) == -1)
+        {
+            perror("pread");
+            codec_close(codec);
+            return -1;
+        }
+        if (get_le32(magic) == ZSTD_FRAME_MAGIC) codec->codec = ACOPY_CODEC_ZSTD;
+        else if (get_le32(magic) == LZ4_FRAME_MAGIC) codec->codec = ACOPY_CODEC_LZ4;
+        else
+        {
+            fprintf(stderr, "The frames of the source are neither zstd nor lz4\n");
+            codec_close(codec);
+            return -1;
+        }
+        codec->library = codec_library_load(codec->codec);
+        if (!codec->library)
+        {
+            codec_close(codec);
+            return -1;
+        }
+        opts->block_size = codec->block_size;
+    }
+    *destination_size = codec->index.count ? codec->index.entries[codec->index.count - 1].original_offset +
+                                             (off_t)codec->index.entries[codec->index.count - 1].original_length : 0;
+    return 0;
+}
+
+void codec_close(struct block_codec *codec)
+{
+    free(codec->index.entries);
+    memset(&codec->index, 0, sizeof(codec->index));
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Block feeder over the frames of a compressed file.
+// -------------------------------------------------------------------------------------------------------
+struct frame_feeder
+{
+    struct block_feeder base;
+    int source_fd, destination_fd;
+    struct frame_index *index;
+    long next;         // Frame handed out next.
+    struct prefetch prefetch;
+};
+
+static int frame_feeder_next(struct block_feeder *base, struct copy_block *block, int wait)
+{
+    struct frame_feeder *feeder = (struct frame_feeder *)base;
+    (void)wait;
+    if (feeder->next >= feeder->index->count) return -1;
+    struct frame_entry *entry = &feeder->index->entries[feeder->next++];
+    block->source_fd = feeder->source_fd;
+    block->destination_fd = feeder->destination_fd;
+    block->offset = entry->offset;
+    block->length = entry->length;
+    block->owner = entry; // codec_place() finds where the data goes.
+    prefetch_advance(&feeder->prefetch, block->offset);
+    return 1;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Run the posix-aio loop with the codec between the reads and the writes. Compressing, the frame index
+// is written after the last frame; destination_size is set to where the destination ends.
+// -------------------------------------------------------------------------------------------------------
+int copy_compressed(int source_fd, int destination_fd, struct block_codec *codec, off_t size, char *buffer, const struct acopy_opts *opts,
+                    off_t *destination_size)
+{
+    int status;
+    if (codec->compress)
+    {
+        struct range_feeder feeder;
+        struct block_range range = {0, size, opts->block_size};
+        range_feeder_init(&feeder, source_fd, destination_fd, &range, opts->block_size);
+        feeder.base.stats = opts->stats;
+        feeder.base.ordered = 1; // Frames are placed in file order.
+        feeder.base.sequential = (opts->hdd == ACOPY_HDD_ON);
+        feeder.base.throttle = opts->throttle;
+        feeder.base.codec = codec;
+        prefetch_init(&feeder.prefetch, source_fd, 0, opts);
+        status = aio_copy_loop(&feeder.base, buffer, opts->block_size, opts->num_async_ops, opts->completion);
+        if (status == 0) status = index_write(&codec->index, destination_fd, codec->output_end, destination_size);
+        return status;
+    }
+
+    struct frame_feeder feeder;
+    memset(&feeder, 0, sizeof(feeder));
+    feeder.base.next = frame_feeder_next;
+    feeder.base.stats = opts->stats;
+    feeder.base.ordered = opts->ordered_writes;
+    feeder.base.sequential = (opts->hdd == ACOPY_HDD_ON);
+    feeder.base.throttle = opts->throttle;
+    feeder.base.codec = codec;
+    feeder.source_fd = source_fd;
+    feeder.destination_fd = destination_fd;
+    feeder.index = &codec->index;
+    prefetch_init(&feeder.prefetch, source_fd, 0, opts);
+    return aio_copy_loop(&feeder.base, buffer, opts->block_size, opts->num_async_ops, opts->completion);
+}
@@ -0,0 +1,57 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "acopy_internal.h"
+
+// -------------------------------------------------------------------------------------------------------
+// Write-behind.
+// A copy much larger than memory otherwise fills the page cache with dirty destination pages and clean
+// source pages, until the kernel throttles the writer and evicts everything else. Instead, once the copy
+// is two windows past the last flushed offset, the newer window is started on its way to the device and
+// the older one is waited for and dropped from the page cache of both files. At most two windows per
+// feeder stay dirty, and the device always has one window of writes queued.
+// -------------------------------------------------------------------------------------------------------
+void writeback_init(struct writeback *writeback, int source_fd, int destination_fd, off_t start, const struct acopy_opts *opts)
+{
+    writeback->source_fd = source_fd;
+    writeback->destination_fd = destination_fd;
+    writeback->window = (opts && opts->durability == ACOPY_DURABILITY_WRITEBEHIND) ? opts->writebehind_bytes : 0;
+    writeback->flushed = start;
+}
+
+void writeback_advance(struct writeback *writeback, off_t offset)
+{
+    if (writeback->window == 0) return;
+    while (offset >= writeback->flushed + 2 * writeback->window)
+    {
+        off_t window = writeback->window;
+        // Failures here are only lost hints; the final fdatasync() reports a write that did not make it.
+        sync_file_range(writeback->destination_fd, writeback->flushed + window, window, SYNC_FILE_RANGE_WRITE);
+        sync_file_range(writeback->destination_fd, writeback->flushed, window,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(writeback->destination_fd, writeback->flushed, window, POSIX_FADV_DONTNEED);
+        posix_fadvise(writeback->source_fd, writeback->flushed, window, POSIX_FADV_DONTNEED);
+        writeback->flushed += window;
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Make a finished copy as durable as the policy asks for. O_DSYNC writes are durable as they complete.
+// -------------------------------------------------------------------------------------------------------
+int durability_flush(int source_fd, int destination_fd, const struct acopy_opts *opts)
+{
+    if (opts->durability != ACOPY_DURABILITY_END && opts->durability != ACOPY_DURABILITY_WRITEBEHIND) return 0;
+    if (fdatasync(destination_fd) == -1)
+    {
+        perror("fdatasync");
+        return -1;
+    }
+    if (opts->durability == ACOPY_DURABILITY_WRITEBEHIND)
+    {
+        // Drop what the write-behind windows did not cover: the last windows and the unaligned tail.
+        posix_fadvise(destination_fd, 0, 0, POSIX_FADV_DONTNEED);
+        posix_fadvise(source_fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    return 0;
+}
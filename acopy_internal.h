@@ -0,0 +1,335 @@
+#ifndef ACOPY_INTERNAL_H
+#define ACOPY_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/time.h>
+#include "acopy.h"
+
+// -------------------------------------------------------------------------------------------------------
+// Declarations shared between the translation units of the library. Not part of the public API.
+// -------------------------------------------------------------------------------------------------------
+
+// One block handed to an engine loop.
+struct copy_block
+{
+    int source_fd, destination_fd;
+    off_t offset;  // Offset of the block in both files.
+    size_t length; // Length of the block.
+    void *owner;   // What the feeder accounts the block to (a file in tree mode).
+};
+
+// Where an engine loop gets its blocks from, and where it hands them back once written.
+// A single file is fed from a block range; a tree copy feeds blocks of many files into one pool.
+struct block_feeder
+{
+    // Returns 1 and fills in the block, 0 if no block is ready yet, -1 when there will be no more.
+    // With wait set it blocks until a block is ready or there are no more.
+    int (*next)(struct block_feeder *feeder, struct copy_block *block, int wait);
+    // Called once per block when it is fully written (status 0) or has failed (status -1). May be NULL.
+    void (*done)(struct block_feeder *feeder, struct copy_block *block, int status);
+    // Where the engine loop records its instrumentation, NULL for none.
+    struct acopy_stats *stats;
+    // Where the engine loop records the digest of every block it copies, NULL for none.
+    struct digest_table *digests;
+    // Start the writes in the order the blocks were handed out, not in the order their reads complete.
+    int ordered;
+    // Keep a single read in flight, so the reads reach the device in the order the blocks were handed out.
+    int sequential;
+    // Rate limits the blocks are handed out under, NULL for none. Use feeder_next(), which applies them.
+    struct acopy_throttle *throttle;
+    // Compress or decompress every block between its read and its write, NULL for none (posix-aio only).
+    struct block_codec *codec;
+};
+
+// Blocks handled by one engine run: start, start + step, ... below end.
+// A single-threaded copy walks the whole file; parallel workers each get a range or a stripe.
+struct block_range
+{
+    off_t start;
+    off_t end;
+    off_t step;
+};
+
+// Write-behind state of one feeder or zero-copy worker, see acopy_durability.c.
+struct writeback
+{
+    int source_fd, destination_fd;
+    off_t window;      // Bytes flushed at a time, 0 when write-behind is off.
+    off_t flushed;     // Everything from the start of the run to here is on the device and out of the page cache.
+};
+
+// Read-ahead state of one feeder or zero-copy worker, see acopy_readahead.c.
+struct prefetch
+{
+    int source_fd;
+    off_t distance;    // How far ahead of the copy the source is read, 0 when read-ahead is off.
+    off_t issued;      // The kernel was asked to read everything up to here.
+};
+
+// Feeder over a block range of one pair of files.
+struct range_feeder
+{
+    struct block_feeder base;
+    int source_fd, destination_fd;
+    struct block_range range;
+    off_t offset;      // Next block to hand out.
+    size_t block_size;
+    struct writeback writeback;
+    struct prefetch prefetch;
+};
+
+// Data extent of a sparse file: [start, end).
+struct extent
+{
+    off_t start;
+    off_t end;
+};
+
+struct extent_list
+{
+    struct extent *extents;
+    int count;
+    int capacity;
+};
+
+// Feeder over the data extents of one pair of files.
+struct extent_feeder
+{
+    struct block_feeder base;
+    int source_fd, destination_fd;
+    const struct extent_list *list;
+    int index;         // Extent the next block comes from.
+    off_t offset;      // Next block to hand out.
+    size_t block_size;
+    struct writeback writeback;
+    struct prefetch prefetch;
+};
+
+// CRC32C of one copied block, taken while the block was in an engine buffer.
+struct digest_entry
+{
+    off_t offset;
+    size_t length; // 0 for an entry no block went through.
+    uint32_t crc;
+};
+
+// Block digests of one copy, indexed by offset / block_size. The last entry takes the unaligned tail of a
+// direct copy, which may start inside a block.
+struct digest_table
+{
+    struct digest_entry *entries;
+    size_t count;
+    size_t block_size;
+};
+
+// A buffer waiting to be hashed, owned by the engine slot that holds the data.
+struct hash_job
+{
+    const char *data;
+    struct digest_entry *entry; // Takes the result; its length says how much to hash.
+    int pending;                // Set until the hash is in the entry; the buffer must not be reused before.
+};
+
+#define HASHER_QUEUE (2 * ACOPY_MAX_IO_OPERATIONS)
+
+// Hashing thread of one engine loop, so the digests overlap with the I/O instead of holding up writes.
+struct block_hasher
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work, finished;
+    struct hash_job *queue[HASHER_QUEUE];
+    int head, count;
+    int stop;
+    struct digest_table *table; // Where hasher_push_block() puts the digests.
+};
+
+// Resume journal of one copy, see acopy_journal.c.
+struct copy_journal
+{
+    int fd;
+    int destination_fd;
+    char path[PATH_MAX];
+    struct journal_header *header; // Shared mapping of the journal file: the header, then the bitmap.
+    size_t map_size;
+    uint8_t *done;                 // Blocks known to be on disk, in the mapping.
+    uint8_t *written;              // Blocks written since the last sync, in memory only.
+    off_t unsynced_bytes;
+    off_t size;                    // Bytes covered by the journal.
+    size_t block_size;
+    off_t blocks;
+    off_t resumed_bytes;           // Bytes a previous run already copied.
+    long redone_blocks;            // Blocks the journal claimed but that did not check out.
+};
+
+// One frame of a compressed file.
+struct frame_entry
+{
+    off_t offset;             // Where the frame starts in the compressed file.
+    size_t length;            // Length of the frame.
+    off_t original_offset;    // Where its data belongs in the original file.
+    size_t original_length;   // Length of its data.
+};
+
+// Frames of a compressed file in file order, as the index at its end lists them.
+struct frame_index
+{
+    struct frame_entry *entries;
+    long count;
+    long capacity;
+};
+
+// A block waiting for a codec thread, owned by the engine slot whose buffers it uses.
+struct codec_job
+{
+    const char *input;
+    size_t input_length;
+    char *output;             // Holds the frame buffer capacity or a block, see codec_push().
+    size_t output_length;     // Bytes the transform produced.
+    int status;               // 0, or -1 if the block could not be compressed or decompressed.
+    int pending;              // Set until the transform is done; the buffers must not be reused before.
+};
+
+#define CODEC_QUEUE (2 * ACOPY_MAX_IO_OPERATIONS)
+
+// Shared library a codec is loaded from, see acopy_compress.c.
+struct codec_library;
+
+// Compression stage of a copy, see acopy_compress.c.
+struct block_codec
+{
+    enum acopy_codec codec;
+    int compress;             // 1 to compress the source, 0 to decompress it.
+    int level;
+    const struct codec_library *library;
+    size_t block_size;        // Largest block of original data.
+    size_t frame_size;        // Largest frame.
+    struct frame_index index;
+    off_t output_end;         // Compressing: the frames placed so far end here.
+    // Codec threads, started for one engine loop.
+    pthread_t threads[ACOPY_MAX_THREADS];
+    int num_threads;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t work, finished;
+    struct codec_job *queue[CODEC_QUEUE];
+    int head, count;
+    int stop;
+    int unseen;               // Jobs finished since the engine loop last waited.
+    void (*wake)(void *arg);  // Called by a codec thread for every finished job.
+    void *wake_arg;
+    char *frames;             // One frame buffer per engine slot.
+};
+
+// Reusable copy context: the buffer pool survives between copies.
+struct acopy_ctx
+{
+    char *buffer;
+    size_t buffer_size;
+    size_t buffer_alignment;
+    int buffer_huge;                // Huge pages were asked for.
+    enum acopy_pages buffer_pages;  // What the buffer ended up in.
+};
+
+// acopy.c
+void range_feeder_init(struct range_feeder *feeder, int source_fd, int destination_fd, const struct block_range *range, size_t block_size);
+int feeder_next(struct block_feeder *feeder, struct copy_block *block, int wait);
+void feeder_done(struct block_feeder *feeder, struct copy_block *block, int status);
+char *ctx_buffer(struct acopy_ctx *ctx, size_t size, size_t alignment, int huge);
+double timespec_diff(const struct timespec *start, const struct timespec *finish);
+double timeval_diff(const struct timeval *start, const struct timeval *finish);
+int copy_range(enum acopy_engine engine, int source_fd, int destination_fd, const struct block_range *range, char *buffer, const struct acopy_opts *opts,
+               struct digest_table *digests);
+
+// acopy_aio.c: buffers must hold 2 * num_async_ops blocks.
+int aio_copy_loop(struct block_feeder *feeder, char *buffer, size_t block_size, int num_async_ops, enum acopy_completion mode);
+void aio_configure(const struct acopy_opts *opts);
+
+// acopy_uring.c: buffers must hold num_async_ops blocks.
+int uring_copy_loop(struct block_feeder *feeder, char *buffer, size_t block_size, int num_async_ops);
+
+// acopy_sparse.c
+int find_data_extents(int fd, off_t size, struct extent_list *list);
+void extent_list_free(struct extent_list *list);
+int prepare_sparse_destination(int destination_fd, off_t total_size, const struct extent_list *list);
+void extent_feeder_init(struct extent_feeder *feeder, int source_fd, int destination_fd, const struct extent_list *list, size_t block_size);
+int copy_extents(enum acopy_engine engine, int source_fd, int destination_fd, const struct extent_list *list, char *buffer, const struct acopy_opts *opts);
+
+// acopy_stats.c: every function does nothing when stats is NULL.
+uint64_t stats_clock(const struct acopy_stats *stats);
+void stats_begin(struct acopy_stats *stats, off_t total_bytes);
+uint64_t stats_latency(struct acopy_stats *stats, int write, uint64_t started_ns);
+void stats_bytes(struct acopy_stats *stats, size_t bytes);
+void stats_depth(struct acopy_stats *stats, int delta);
+uint64_t stats_totals(struct acopy_stats *stats, uint64_t *completions, uint64_t *bytes);
+uint64_t stats_submit(struct acopy_stats *stats, uint64_t started_ns);
+uint64_t stats_wait(struct acopy_stats *stats, uint64_t started_ns);
+
+// acopy_verify.c: hasher_push_block(), hasher_wait() and hasher_stop() do nothing without a hasher.
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t length_b);
+int digest_table_init(struct digest_table *table, off_t size, size_t block_size);
+void digest_table_free(struct digest_table *table);
+struct digest_entry *digest_table_entry(struct digest_table *table, off_t offset);
+uint32_t digest_table_combine(const struct digest_table *table, long *blocks);
+int digest_table_write(const struct digest_table *table, const char *path, uint32_t digest);
+int hasher_start(struct block_hasher *hasher, struct digest_table *table);
+void hasher_stop(struct block_hasher *hasher);
+void hasher_push(struct block_hasher *hasher, struct hash_job *job, const char *data, struct digest_entry *entry);
+void hasher_push_block(struct block_hasher *hasher, struct hash_job *job, const char *data, const struct copy_block *block);
+void hasher_wait(struct block_hasher *hasher, struct hash_job *job);
+// Buffer must hold two blocks.
+int verify_readback(int destination_fd, const char *destination_path, const struct digest_table *table, char *buffer, long *mismatches);
+
+// acopy_journal.c
+int journal_open(struct copy_journal *journal, const char *destination_path, int source_fd, int destination_fd, const struct stat *source_stat,
+                 off_t size, size_t block_size, char *buffer);
+int journal_close(struct copy_journal *journal, int status);
+int copy_journaled(enum acopy_engine engine, int source_fd, int destination_fd, struct copy_journal *journal, char *buffer, const struct acopy_opts *opts);
+
+// acopy_durability.c: writeback_advance() does nothing unless opts asked for write-behind.
+void writeback_init(struct writeback *writeback, int source_fd, int destination_fd, off_t start, const struct acopy_opts *opts);
+void writeback_advance(struct writeback *writeback, off_t offset);
+int durability_flush(int source_fd, int destination_fd, const struct acopy_opts *opts);
+
+// acopy_layout.c
+int prepare_destination(int destination_fd, off_t total_size, const struct acopy_opts *opts);
+int count_extents(int fd, int sync);
+
+// acopy_readahead.c: prefetch_advance() does nothing unless opts asked for read-ahead.
+int hdd_mode(const struct acopy_opts *opts, dev_t source_dev, dev_t destination_dev);
+void hdd_opts(struct acopy_opts *resolved, const struct acopy_opts *opts, int hdd);
+void prefetch_init(struct prefetch *prefetch, int source_fd, off_t start, const struct acopy_opts *opts);
+void prefetch_advance(struct prefetch *prefetch, off_t offset);
+
+// acopy_throttle.c: both do nothing without a throttle.
+int throttle_ready(struct acopy_throttle *throttle, struct acopy_stats *stats, int wait);
+void throttle_charge(struct acopy_throttle *throttle, size_t bytes);
+
+// acopy_compress.c: codec_open() settles the block size of opts for decompression.
+int codec_open(struct block_codec *codec, int source_fd, off_t source_size, struct acopy_opts *opts, off_t *destination_size);
+void codec_close(struct block_codec *codec);
+int codec_start(struct block_codec *codec, int num_slots, void (*wake)(void *arg), void *wake_arg);
+void codec_stop(struct block_codec *codec);
+void codec_buffers(struct block_codec *codec, int slot, char *block_buffer, char **input, char **output);
+void codec_push(struct block_codec *codec, struct codec_job *job, const char *input, size_t length, char *output);
+int codec_finished(struct block_codec *codec, struct codec_job *job);
+void codec_wait(struct block_codec *codec);
+off_t codec_place(struct block_codec *codec, const struct copy_block *block, size_t length);
+int copy_compressed(int source_fd, int destination_fd, struct block_codec *codec, off_t size, char *buffer, const struct acopy_opts *opts,
+                    off_t *destination_size);
+
+// acopy_tune.c
+int copy_auto_tuned(struct acopy_ctx *ctx, enum acopy_engine engine, int source_fd, int destination_fd, off_t total_size, size_t alignment, const struct acopy_opts *opts, struct acopy_report *report);
+
+// acopy_zerocopy.c
+int copy_zero_copy(enum acopy_engine engine, int source_fd, int destination_fd, off_t start, off_t end, const struct acopy_opts *opts);
+int zero_copy_unsupported(int error);
+
+#endif
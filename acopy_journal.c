@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "acopy_internal.h"
+
+#define JOURNAL_MAGIC "ACOPYJ1"
+#define JOURNAL_SUFFIX ".acopy-journal"
+// Written blocks are made durable and marked in the journal in batches of this many bytes.
+#define JOURNAL_SYNC_BYTES (256 * 1024 * 1024)
+// Blocks at the end of the journal compared with the source before a copy resumes.
+#define JOURNAL_VALIDATE_BLOCKS 16
+
+// On-disk header, followed by one bit per block.
+struct journal_header
+{
+    char magic[8];
+    uint64_t block_size;
+    uint64_t blocks;
+    // The source the journal was written for; a journal for another version of it is useless.
+    uint64_t source_size;
+    uint64_t source_ino;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+};
+
+// -------------------------------------------------------------------------------------------------------
+// Resume journal.
+// A bitmap of the blocks known to be on disk, kept in a file next to the destination and mapped shared.
+// A finished write is first only noted in memory; every JOURNAL_SYNC_BYTES the destination is synced and
+// only then are the noted blocks set in the mapping and the mapping synced. A bit therefore never claims a
+// block the destination could still lose, and a crash costs at most one batch.
+// -------------------------------------------------------------------------------------------------------
+static int journal_bit(const uint8_t *bitmap, off_t block)
+{
+    return (bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+static void journal_set_bit(uint8_t *bitmap, off_t block, int value)
+{
+    if (value) bitmap[block / 8] |= 1 << (block % 8);
+    else bitmap[block / 8] &= ~(1 << (block % 8));
+}
+
+static off_t journal_block_length(const struct copy_journal *journal, off_t block)
+{
+    off_t offset = block * journal->block_size;
+    return (journal->size - offset < (off_t)journal->block_size) ? journal->size - offset : (off_t)journal->block_size;
+}
+
+// Make the noted writes durable and mark them in the journal.
+static int journal_sync(struct copy_journal *journal)
+{
+    if (journal->unsynced_bytes == 0) return 0;
+    if (fdatasync(journal->destination_fd) == -1)
+    {
+        perror("fdatasync");
+        return -1;
+    }
+    for (off_t i = 0; i < (journal->blocks + 7) / 8; i++)
+    {
+        journal->done[i] |= journal->written[i];
+        journal->written[i] = 0;
+    }
+    if (msync(journal->header, journal->map_size, MS_SYNC) == -1)
+    {
+        perror("msync journal");
+        return -1;
+    }
+    journal->unsynced_bytes = 0;
+    return 0;
+}
+
+// Compare the last blocks the journal claims with the source, and unmark any that do not match or that
+// the destination no longer has.
+static void journal_validate(struct copy_journal *journal, int source_fd, char *buffer)
+{
+    struct stat destination_stat;
+    off_t destination_size = (fstat(journal->destination_fd, &destination_stat) == 0) ? destination_stat.st_size : 0;
+    int checked = 0;
+
+    for (off_t block = journal->blocks - 1; block >= 0; block--)
+    {
+        if (!journal_bit(journal->done, block)) continue;
+        off_t offset = block * journal->block_size;
+        off_t length = journal_block_length(journal, block);
+        int valid = offset + length <= destination_size;
+        if (valid && checked < JOURNAL_VALIDATE_BLOCKS)
+        {
+            char *source = buffer, *destination = buffer + journal->block_size;
+            valid = pread(source_fd, source, length, offset) == length && pread(journal->destination_fd, destination, length, offset) == length &&
+                    memcmp(source, destination, length) == 0;
+            checked++;
+        }
+        if (!valid)
+        {
+            journal_set_bit(journal->done, block, 0);
+            journal->redone_blocks++;
+        }
+    }
+}
+
+int journal_open(struct copy_journal *journal, const char *destination_path, int source_fd, int destination_fd, const struct stat *source_stat,
+                 off_t size, size_t block_size, char *buffer)
+{
+    struct journal_header expected;
+    struct stat journal_stat;
+    int existing, fresh;
+
+    memset(journal, 0, sizeof(*journal));
+    journal->destination_fd = destination_fd;
+    journal->size = size;
+    journal->block_size = block_size;
+    journal->blocks = (size + block_size - 1) / block_size;
+    journal->map_size = sizeof(struct journal_header) + (journal->blocks + 7) / 8;
+    snprintf(journal->path, sizeof(journal->path), "%s%s", destination_path, JOURNAL_SUFFIX);
+
+    memset(&expected, 0, sizeof(expected));
+    memcpy(expected.magic, JOURNAL_MAGIC, sizeof(expected.magic));
+    expected.block_size = block_size;
+    expected.blocks = journal->blocks;
+    expected.source_size = source_stat->st_size;
+    expected.source_ino = source_stat->st_ino;
+    expected.source_mtime_sec = source_stat->st_mtim.tv_sec;
+    expected.source_mtime_nsec = source_stat->st_mtim.tv_nsec;
+
+    journal->fd = open(journal->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (journal->fd == -1 || fstat(journal->fd, &journal_stat) == -1)
+    {
+        perror(journal->path);
+        if (journal->fd != -1) close(journal->fd);
+        return -1;
+    }
+    // An empty journal was just created; one of another length is for another size or block size.
+    existing = journal_stat.st_size > 0;
+    fresh = journal_stat.st_size != (off_t)journal->map_size;
+    if (ftruncate(journal->fd, journal->map_size) == -1)
+    {
+        perror("ftruncate journal");
+        close(journal->fd);
+        return -1;
+    }
+    journal->header = mmap(NULL, journal->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+    journal->written = calloc((journal->blocks + 7) / 8 + 1, 1);
+    if (journal->header == MAP_FAILED || !journal->written)
+    {
+        perror("journal");
+        if (journal->header != MAP_FAILED) munmap(journal->header, journal->map_size);
+        free(journal->written);
+        close(journal->fd);
+        return -1;
+    }
+    journal->done = (uint8_t *)(journal->header + 1);
+
+    if (!fresh && memcmp(journal->header, &expected, sizeof(expected)) != 0) fresh = 1;
+    if (existing && fresh)
+    {
+        // The source was modified or replaced since, or the copy used another block size.
+        fprintf(stderr, "%s does not match this copy (the source changed or another block size was used); copying from the start\n", journal->path);
+    }
+    if (fresh)
+    {
+        memset(journal->done, 0, journal->map_size - sizeof(struct journal_header));
+        *journal->header = expected;
+        if (msync(journal->header, journal->map_size, MS_SYNC) == -1)
+        {
+            perror("msync journal");
+            journal_close(journal, -1);
+            return -1;
+        }
+        return 0;
+    }
+
+    journal_validate(journal, source_fd, buffer);
+    for (off_t block = 0; block < journal->blocks; block++)
+    {
+        if (journal_bit(journal->done, block)) journal->resumed_bytes += journal_block_length(journal, block);
+    }
+    return 0;
+}
+
+// After a successful copy the destination is synced and the journal removed; after a failed one the
+// writes that did finish are synced and kept, so the next run picks up from there.
+int journal_close(struct copy_journal *journal, int status)
+{
+    int result = journal_sync(journal);
+    if (status == 0 && result == 0)
+    {
+        if (fdatasync(journal->destination_fd) == -1)
+        {
+            perror("fdatasync");
+            result = -1;
+        }
+        else if (unlink(journal->path) == -1)
+        {
+            perror(journal->path);
+            result = -1;
+        }
+    }
+    munmap(journal->header, journal->map_size);
+    free(journal->written);
+    close(journal->fd);
+    return result;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Block feeder over the blocks the journal does not have yet.
+// -------------------------------------------------------------------------------------------------------
+struct journal_feeder
+{
+    struct block_feeder base;
+    struct range_feeder range;
+    struct copy_journal *journal;
+    int failed; // A sync failed; no more blocks are handed out.
+};
+
+static int journal_feeder_next(struct block_feeder *base, struct copy_block *block, int wait)
+{
+    struct journal_feeder *feeder = (struct journal_feeder *)base;
+    if (feeder->failed) return -1;
+    for (;;)
+    {
+        int got = feeder->range.base.next(&feeder->range.base, block, wait);
+        if (got != 1 || !journal_bit(feeder->journal->done, block->offset / feeder->journal->block_size)) return got;
+    }
+}
+
+static void journal_feeder_done(struct block_feeder *base, struct copy_block *block, int status)
+{
+    struct journal_feeder *feeder = (struct journal_feeder *)base;
+    struct copy_journal *journal = feeder->journal;
+    if (status == -1 || block->length == 0) return;
+    journal_set_bit(journal->written, block->offset / journal->block_size, 1);
+    journal->unsynced_bytes += block->length;
+    if (journal->unsynced_bytes >= JOURNAL_SYNC_BYTES && journal_sync(journal) == -1) feeder->failed = 1;
+}
+
+int copy_journaled(enum acopy_engine engine, int source_fd, int destination_fd, struct copy_journal *journal, char *buffer, const struct acopy_opts *opts)
+{
+    struct journal_feeder feeder;
+    struct block_range range = {0, journal->size, journal->block_size};
+    int status;
+
+    range_feeder_init(&feeder.range, source_fd, destination_fd, &range, journal->block_size);
+    writeback_init(&feeder.range.writeback, source_fd, destination_fd, 0, opts);
+    prefetch_init(&feeder.range.prefetch, source_fd, 0, opts);
+    feeder.base.next = journal_feeder_next;
+    feeder.base.done = journal_feeder_done;
+    feeder.base.stats = opts->stats;
+    feeder.base.digests = NULL;
+    feeder.base.ordered = opts->ordered_writes;
+    feeder.base.sequential = (opts->hdd == ACOPY_HDD_ON);
+    feeder.base.throttle = opts->throttle;
+    feeder.base.codec = NULL;
+    feeder.journal = journal;
+    feeder.failed = 0;
+    if (engine == ACOPY_ENGINE_IO_URING) status = uring_copy_loop(&feeder.base, buffer, opts->block_size, opts->num_async_ops);
+    else status = aio_copy_loop(&feeder.base, buffer, opts->block_size, opts->num_async_ops, opts->completion);
+    return (status == -1 || feeder.failed) ? -1 : 0;
+}
@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "acopy_internal.h"
+
+// -------------------------------------------------------------------------------------------------------
+// Destination layout.
+// The destination is cut to nothing and its full size is allocated before the first write, so the
+// filesystem can hand out one long run of blocks instead of growing the file piece by piece as blocks
+// complete out of order, and a full disk fails the copy before any data moves. A resumed copy keeps what
+// is there and only has the holes filled in.
+// -------------------------------------------------------------------------------------------------------
+int prepare_destination(int destination_fd, off_t total_size, const struct acopy_opts *opts)
+{
+    if (!opts->resume && ftruncate(destination_fd, 0) == -1)
+    {
+        perror("ftruncate");
+        return -1;
+    }
+    if (!opts->preallocate || total_size == 0)
+    {
+        // Copying between mappings stores into the destination's pages, which must exist whether or not they are allocated.
+        if (opts->mmap_copy && ftruncate(destination_fd, total_size) == -1)
+        {
+            perror("ftruncate");
+            return -1;
+        }
+        return 0;
+    }
+    if (fallocate(destination_fd, opts->resume ? FALLOC_FL_KEEP_SIZE : 0, 0, total_size) == -1)
+    {
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+        {
+            perror("fallocate");
+            return -1;
+        }
+        // No preallocation here; setting the final size still spares the filesystem most of the extending.
+        if (!opts->resume && ftruncate(destination_fd, total_size) == -1)
+        {
+            perror("ftruncate");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Extents the file is made of, -1 if the filesystem cannot tell. With sync set, delayed allocations are
+// flushed first so they count as the extents they end up in.
+int count_extents(int fd, int sync)
+{
+    struct fiemap map;
+    memset(&map, 0, sizeof(map));
+    map.fm_length = FIEMAP_MAX_OFFSET;
+    map.fm_flags = sync ? FIEMAP_FLAG_SYNC : 0;
+    map.fm_extent_count = 0; // Only count them.
+    if (ioctl(fd, FS_IOC_FIEMAP, &map) == -1) return -1;
+    return map.fm_mapped_extents;
+}
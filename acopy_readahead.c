@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "acopy_internal.h"
+
+// Read-ahead distance of HDD mode when none is given.
+#define HDD_READAHEAD_BYTES (16 * 1024 * 1024)
+
+// -------------------------------------------------------------------------------------------------------
+// HDD mode.
+// On a spinning disk every seek costs milliseconds, and the AIO thread pool or a deep queue issues the
+// reads of one file out of order. In HDD mode the engine loops keep one read in flight, in file order,
+// start the writes in file order, and ask the kernel to read ahead of them, so the head streams.
+// -------------------------------------------------------------------------------------------------------
+
+// 1 for a spinning disk, 0 for anything else, -1 if sysfs does not know the device.
+static int device_rotational(dev_t dev)
+{
+    char path[128];
+    int value = -1;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        // A partition has no queue of its own; the disk it is on does.
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+        file = fopen(path, "r");
+    }
+    if (!file) return -1;
+    if (fscanf(file, "%d", &value) != 1) value = -1;
+    fclose(file);
+    return value;
+}
+
+// Whether a copy between these devices runs in HDD mode: as asked, or when either of them spins.
+int hdd_mode(const struct acopy_opts *opts, dev_t source_dev, dev_t destination_dev)
+{
+    if (opts->hdd != ACOPY_HDD_AUTO) return opts->hdd == ACOPY_HDD_ON;
+    return device_rotational(source_dev) == 1 || device_rotational(destination_dev) == 1;
+}
+
+// The options with HDD mode settled: on with its defaults filled in, or off.
+void hdd_opts(struct acopy_opts *resolved, const struct acopy_opts *opts, int hdd)
+{
+    *resolved = *opts;
+    resolved->hdd = hdd ? ACOPY_HDD_ON : ACOPY_HDD_OFF;
+    if (!hdd) return;
+    resolved->ordered_writes = 1;
+    if (resolved->readahead_bytes == 0) resolved->readahead_bytes = HDD_READAHEAD_BYTES;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Read-ahead.
+// The source is asked for up to distance bytes ahead of the block a feeder hands out, in steps of a
+// quarter of the distance, so the reads find their data in the page cache. Direct copies skip it.
+// -------------------------------------------------------------------------------------------------------
+void prefetch_init(struct prefetch *prefetch, int source_fd, off_t start, const struct acopy_opts *opts)
+{
+    prefetch->source_fd = source_fd;
+    prefetch->distance = (opts && !opts->direct) ? opts->readahead_bytes : 0;
+    prefetch->issued = start;
+}
+
+void prefetch_advance(struct prefetch *prefetch, off_t offset)
+{
+    if (prefetch->distance == 0) return;
+    if (prefetch->issued < offset) prefetch->issued = offset; // Skipped ahead, over a hole or to a new stripe.
+    if (offset + prefetch->distance < prefetch->issued + prefetch->distance / 4) return;
+    off_t target = offset + prefetch->distance;
+    // readahead() only works on files in the page cache; fadvise says the same for anything else.
+    if (readahead(prefetch->source_fd, prefetch->issued, target - prefetch->issued) == -1)
+    {
+        posix_fadvise(prefetch->source_fd, prefetch->issued, target - prefetch->issued, POSIX_FADV_WILLNEED);
+    }
+    prefetch->issued = target;
+}
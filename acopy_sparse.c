@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "acopy_internal.h"
+
+// FIEMAP extents fetched per ioctl.
+#define FIEMAP_BATCH 256
+
+// -------------------------------------------------------------------------------------------------------
+// Sparse files.
+// Only the data extents of the source are read and written; the destination is cut to the exact size
+// first, so everything in between stays a hole.
+// -------------------------------------------------------------------------------------------------------
+static int extent_list_add(struct extent_list *list, off_t start, off_t end)
+{
+    if (start >= end) return 0;
+    // Adjacent pieces (FIEMAP splits long runs) become one extent.
+    if (list->count > 0 && list->extents[list->count - 1].end == start)
+    {
+        list->extents[list->count - 1].end = end;
+        return 0;
+    }
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? 2 * list->capacity : 64;
+        struct extent *extents = realloc(list->extents, capacity * sizeof(struct extent));
+        if (!extents)
+        {
+            perror("realloc");
+            return -1;
+        }
+        list->extents = extents;
+        list->capacity = capacity;
+    }
+    list->extents[list->count].start = start;
+    list->extents[list->count].end = end;
+    list->count++;
+    return 0;
+}
+
+void extent_list_free(struct extent_list *list)
+{
+    free(list->extents);
+    memset(list, 0, sizeof(*list));
+}
+
+// Walk the data with SEEK_DATA/SEEK_HOLE. Returns -1 with errno EINVAL if the filesystem cannot tell.
+static int find_extents_seek(int fd, off_t size, struct extent_list *list)
+{
+    off_t offset = 0;
+    while (offset < size)
+    {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data == -1)
+        {
+            if (errno == ENXIO) break; // Only a hole is left.
+            return -1;
+        }
+        if (data >= size) break;
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) return -1;
+        if (hole > size) hole = size;
+        if (extent_list_add(list, data, hole) == -1) return -1;
+        offset = hole;
+    }
+    return 0;
+}
+
+// Walk the extents with FIEMAP. Unwritten (preallocated) extents read back as zeros, so they count as holes.
+static int find_extents_fiemap(int fd, off_t size, struct extent_list *list)
+{
+    struct fiemap *map = calloc(1, sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+    off_t offset = 0;
+    int last = 0;
+    if (!map)
+    {
+        perror("calloc");
+        return -1;
+    }
+    while (!last && offset < size)
+    {
+        map->fm_start = offset;
+        map->fm_length = size - offset;
+        map->fm_flags = FIEMAP_FLAG_SYNC; // Delayed allocations have no extents until they are flushed.
+        map->fm_extent_count = FIEMAP_BATCH;
+        if (ioctl(fd, FS_IOC_FIEMAP, map) == -1)
+        {
+            free(map);
+            return -1;
+        }
+        if (map->fm_mapped_extents == 0) break;
+        for (unsigned i = 0; i < map->fm_mapped_extents; i++)
+        {
+            struct fiemap_extent *extent = &map->fm_extents[i];
+            off_t start = extent->fe_logical;
+            off_t end = start + extent->fe_length;
+            if (end > size) end = size;
+            if (!(extent->fe_flags & FIEMAP_EXTENT_UNWRITTEN) && extent_list_add(list, start, end) == -1)
+            {
+                free(map);
+                return -1;
+            }
+            offset = start + extent->fe_length;
+            if (extent->fe_flags & FIEMAP_EXTENT_LAST) last = 1;
+        }
+    }
+    free(map);
+    return 0;
+}
+
+// Data extents of the first size bytes of a file. Without SEEK_DATA or FIEMAP support it is all data.
+int find_data_extents(int fd, off_t size, struct extent_list *list)
+{
+    memset(list, 0, sizeof(*list));
+    if (find_extents_seek(fd, size, list) == 0) return 0;
+    list->count = 0;
+    if (errno != EINVAL && errno != EOPNOTSUPP) return -1;
+    if (find_extents_fiemap(fd, size, list) == 0) return 0;
+    list->count = 0;
+    if (errno != EINVAL && errno != EOPNOTSUPP && errno != ENOTTY) return -1;
+    return extent_list_add(list, 0, size);
+}
+
+// Cut the destination to the exact size, dropping whatever an earlier copy left in the holes, and reserve
+// space for the data extents so they are laid out contiguously.
+int prepare_sparse_destination(int destination_fd, off_t total_size, const struct extent_list *list)
+{
+    if (ftruncate(destination_fd, 0) == -1 || ftruncate(destination_fd, total_size) == -1)
+    {
+        perror("ftruncate");
+        return -1;
+    }
+    for (int i = 0; i < list->count; i++)
+    {
+        const struct extent *extent = &list->extents[i];
+        if (fallocate(destination_fd, FALLOC_FL_KEEP_SIZE, extent->start, extent->end - extent->start) == -1)
+        {
+            if (errno == EOPNOTSUPP || errno == ENOSYS) break; // Preallocation is only a layout hint.
+            perror("fallocate");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Block feeder over the data extents of one pair of files.
+// -------------------------------------------------------------------------------------------------------
+static int extent_feeder_next(struct block_feeder *base, struct copy_block *block, int wait)
+{
+    struct extent_feeder *feeder = (struct extent_feeder *)base;
+    (void)wait;
+    if (feeder->index < feeder->list->count && feeder->offset >= feeder->list->extents[feeder->index].end)
+    {
+        if (++feeder->index < feeder->list->count) feeder->offset = feeder->list->extents[feeder->index].start;
+    }
+    if (feeder->index >= feeder->list->count) return -1;
+    off_t end = feeder->list->extents[feeder->index].end;
+    block->source_fd = feeder->source_fd;
+    block->destination_fd = feeder->destination_fd;
+    block->offset = feeder->offset;
+    block->length = (end - feeder->offset < (off_t)feeder->block_size) ? (size_t)(end - feeder->offset) : feeder->block_size;
+    block->owner = NULL;
+    feeder->offset += block->length;
+    prefetch_advance(&feeder->prefetch, block->offset);
+    writeback_advance(&feeder->writeback, block->offset);
+    return 1;
+}
+
+void extent_feeder_init(struct extent_feeder *feeder, int source_fd, int destination_fd, const struct extent_list *list, size_t block_size)
+{
+    feeder->base.next = extent_feeder_next;
+    feeder->base.done = NULL;
+    feeder->base.stats = NULL;
+    feeder->base.digests = NULL;
+    feeder->base.ordered = 0;
+    feeder->base.sequential = 0;
+    feeder->base.throttle = NULL;
+    feeder->base.codec = NULL;
+    feeder->source_fd = source_fd;
+    feeder->destination_fd = destination_fd;
+    feeder->list = list;
+    feeder->index = 0;
+    feeder->offset = list->count > 0 ? list->extents[0].start : 0;
+    feeder->block_size = block_size;
+    writeback_init(&feeder->writeback, source_fd, destination_fd, feeder->offset, NULL);
+    prefetch_init(&feeder->prefetch, source_fd, feeder->offset, NULL);
+}
+
+// Copy the data extents with one engine: the queue engines walk them through one feeder, the zero-copy
+// engines take them one extent at a time.
+int copy_extents(enum acopy_engine engine, int source_fd, int destination_fd, const struct extent_list *list, char *buffer, const struct acopy_opts *opts)
+{
+    if (engine == ACOPY_ENGINE_POSIX_AIO || engine == ACOPY_ENGINE_IO_URING)
+    {
+        struct extent_feeder feeder;
+        extent_feeder_init(&feeder, source_fd, destination_fd, list, opts->block_size);
+        feeder.base.stats = opts->stats;
+        feeder.base.ordered = opts->ordered_writes;
+        feeder.base.sequential = (opts->hdd == ACOPY_HDD_ON);
+        feeder.base.throttle = opts->throttle;
+        writeback_init(&feeder.writeback, source_fd, destination_fd, feeder.offset, opts);
+        prefetch_init(&feeder.prefetch, source_fd, feeder.offset, opts);
+        if (engine == ACOPY_ENGINE_IO_URING) return uring_copy_loop(&feeder.base, buffer, opts->block_size, opts->num_async_ops);
+        return aio_copy_loop(&feeder.base, buffer, opts->block_size, opts->num_async_ops, opts->completion);
+    }
+    for (int i = 0; i < list->count; i++)
+    {
+        if (copy_zero_copy(engine, source_fd, destination_fd, list->extents[i].start, list->extents[i].end, opts) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "acopy_internal.h"
+
+// -------------------------------------------------------------------------------------------------------
+// Instrumentation.
+// The engine loops record into a shared acopy_stats with relaxed atomics only: a latency histogram per
+// direction, bytes written, the in-flight depth, and time spent submitting vs waiting. Whoever watches
+// the copy calls acopy_stats_sample() periodically; that side keeps the moving window and the depth
+// series under a lock, so the hot path never takes it.
+// -------------------------------------------------------------------------------------------------------
+
+// Log-linear buckets in the style of HDR histograms: 2^HISTOGRAM_SUB_BITS buckets per power of two,
+// about 3% precision from 1 ns to 2^HISTOGRAM_MAX_BITS ns (~18 minutes).
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+// Samples in the moving window, and points kept of the depth/throughput series.
+#define STATS_WINDOW 20
+#define STATS_SERIES 512
+
+struct latency_histogram
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+};
+
+struct stats_sample
+{
+    uint64_t time_ns;  // Since the copy started.
+    uint64_t bytes;
+    int depth;
+};
+
+struct acopy_stats
+{
+    // Written by the engine loops.
+    struct latency_histogram reads, writes;
+    uint64_t bytes_done;
+    uint64_t bytes_total;
+    int64_t in_flight;
+    int64_t max_depth;
+    uint64_t submit_ns;
+    uint64_t wait_ns;
+    uint64_t start_ns;
+
+    // Sampling side.
+    pthread_mutex_t lock;
+    struct stats_sample window[STATS_WINDOW];
+    int window_next, window_count;
+    struct stats_sample series[STATS_SERIES];
+    int series_count;
+    uint64_t series_interval_ns; // Doubles whenever the series is full and gets thinned out.
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS) return value;
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+// Highest value that falls into a bucket.
+static uint64_t histogram_bucket_limit(int bucket)
+{
+    int group = bucket / HISTOGRAM_SUB_BUCKETS;
+    int sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    if (group == 0) return sub;
+    return ((uint64_t)(HISTOGRAM_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+static uint64_t histogram_percentile(const struct latency_histogram *histogram, uint64_t count, double percentile)
+{
+    uint64_t rank = (uint64_t)(percentile / 100.0 * count + 0.5);
+    uint64_t seen = 0;
+    if (rank == 0) rank = 1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank) return histogram_bucket_limit(i);
+    }
+    return __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Recording side, called from the engine loops. Every function does nothing without stats.
+// -------------------------------------------------------------------------------------------------------
+uint64_t stats_clock(const struct acopy_stats *stats)
+{
+    return stats ? monotonic_ns() : 0;
+}
+
+void stats_begin(struct acopy_stats *stats, off_t total_bytes)
+{
+    if (!stats) return;
+    uint64_t zero = 0;
+    __atomic_compare_exchange_n(&stats->start_ns, &zero, monotonic_ns(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes_total, total_bytes, __ATOMIC_RELAXED);
+}
+
+// Latency of an operation submitted at started_ns that has just completed; returns the current time.
+uint64_t stats_latency(struct acopy_stats *stats, int write, uint64_t started_ns)
+{
+    if (!stats) return 0;
+    struct latency_histogram *histogram = write ? &stats->writes : &stats->reads;
+    uint64_t now = monotonic_ns();
+    uint64_t latency = now - started_ns;
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->counts[histogram_bucket(latency)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum_ns, latency, __ATOMIC_RELAXED);
+    while (latency > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, latency, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return now;
+}
+
+void stats_bytes(struct acopy_stats *stats, size_t bytes)
+{
+    if (stats) __atomic_fetch_add(&stats->bytes_done, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_depth(struct acopy_stats *stats, int delta)
+{
+    if (!stats) return;
+    int64_t depth = __atomic_add_fetch(&stats->in_flight, delta, __ATOMIC_RELAXED);
+    int64_t max = __atomic_load_n(&stats->max_depth, __ATOMIC_RELAXED);
+    while (depth > max && !__atomic_compare_exchange_n(&stats->max_depth, &max, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Summed latency of every completed read and write; completions and bytes written so far go to the pointers.
+uint64_t stats_totals(struct acopy_stats *stats, uint64_t *completions, uint64_t *bytes)
+{
+    *completions = __atomic_load_n(&stats->reads.count, __ATOMIC_RELAXED) + __atomic_load_n(&stats->writes.count, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&stats->bytes_done, __ATOMIC_RELAXED);
+    return __atomic_load_n(&stats->reads.sum_ns, __ATOMIC_RELAXED) + __atomic_load_n(&stats->writes.sum_ns, __ATOMIC_RELAXED);
+}
+
+// Time since started_ns was spent submitting (or waiting); returns the current time.
+uint64_t stats_submit(struct acopy_stats *stats, uint64_t started_ns)
+{
+    if (!stats) return 0;
+    uint64_t now = monotonic_ns();
+    __atomic_fetch_add(&stats->submit_ns, now - started_ns, __ATOMIC_RELAXED);
+    return now;
+}
+
+uint64_t stats_wait(struct acopy_stats *stats, uint64_t started_ns)
+{
+    if (!stats) return 0;
+    uint64_t now = monotonic_ns();
+    __atomic_fetch_add(&stats->wait_ns, now - started_ns, __ATOMIC_RELAXED);
+    return now;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Sampling and output.
+// -------------------------------------------------------------------------------------------------------
+struct acopy_stats *acopy_stats_new(void)
+{
+    struct acopy_stats *stats = calloc(1, sizeof(struct acopy_stats));
+    if (!stats)
+    {
+        perror("calloc");
+        return NULL;
+    }
+    pthread_mutex_init(&stats->lock, NULL);
+    stats->series_interval_ns = 1000000000ULL;
+    return stats;
+}
+
+void acopy_stats_free(struct acopy_stats *stats)
+{
+    if (!stats) return;
+    pthread_mutex_destroy(&stats->lock);
+    free(stats);
+}
+
+static uint64_t stats_elapsed_ns(const struct acopy_stats *stats)
+{
+    uint64_t start = __atomic_load_n(&stats->start_ns, __ATOMIC_RELAXED);
+    return start ? monotonic_ns() - start : 0;
+}
+
+void acopy_stats_sample(struct acopy_stats *stats)
+{
+    struct stats_sample sample;
+    sample.time_ns = stats_elapsed_ns(stats);
+    sample.bytes = __atomic_load_n(&stats->bytes_done, __ATOMIC_RELAXED);
+    sample.depth = __atomic_load_n(&stats->in_flight, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&stats->lock);
+    stats->window[stats->window_next] = sample;
+    stats->window_next = (stats->window_next + 1) % STATS_WINDOW;
+    if (stats->window_count < STATS_WINDOW) stats->window_count++;
+
+    if (stats->series_count == 0 || sample.time_ns >= stats->series[stats->series_count - 1].time_ns + stats->series_interval_ns)
+    {
+        if (stats->series_count == STATS_SERIES)
+        {
+            // Keep every other point and halve the resolution, so a copy of any length fits.
+            for (int i = 0; i < STATS_SERIES / 2; i++) stats->series[i] = stats->series[2 * i + 1];
+            stats->series_count = STATS_SERIES / 2;
+            stats->series_interval_ns *= 2;
+        }
+        stats->series[stats->series_count++] = sample;
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+// Bytes per second over the moving window, called with the lock held.
+static double stats_window_rate(const struct acopy_stats *stats)
+{
+    if (stats->window_count < 2) return 0;
+    const struct stats_sample *newest = &stats->window[(stats->window_next + STATS_WINDOW - 1) % STATS_WINDOW];
+    const struct stats_sample *oldest = &stats->window[(stats->window_next + STATS_WINDOW - stats->window_count) % STATS_WINDOW];
+    if (newest->time_ns <= oldest->time_ns) return 0;
+    return (newest->bytes - oldest->bytes) / ((newest->time_ns - oldest->time_ns) / 1e9);
+}
+
+void acopy_stats_print_progress(FILE *out, struct acopy_stats *stats)
+{
+    double elapsed = stats_elapsed_ns(stats) / 1e9;
+    double done = __atomic_load_n(&stats->bytes_done, __ATOMIC_RELAXED) / (1024.0 * 1024);
+    double total = __atomic_load_n(&stats->bytes_total, __ATOMIC_RELAXED) / (1024.0 * 1024);
+    uint64_t reads = __atomic_load_n(&stats->reads.count, __ATOMIC_RELAXED);
+    uint64_t writes = __atomic_load_n(&stats->writes.count, __ATOMIC_RELAXED);
+    double submit = __atomic_load_n(&stats->submit_ns, __ATOMIC_RELAXED) / 1e9;
+    double wait = __atomic_load_n(&stats->wait_ns, __ATOMIC_RELAXED) / 1e9;
+
+    pthread_mutex_lock(&stats->lock);
+    double window = stats_window_rate(stats) / (1024 * 1024);
+    pthread_mutex_unlock(&stats->lock);
+
+    fprintf(out, "%8.1f s  %10.1f / %.1f MB (%5.1f%%)  %8.1f MB/s now  %8.1f MB/s avg  depth %3lld  "
+            "read p99 %.3f ms  write p99 %.3f ms  submit %.2f s  wait %.2f s\n",
+            elapsed, done, total, total > 0 ? 100.0 * done / total : 0.0, window, elapsed > 0 ? done / elapsed : 0.0,
+            (long long)__atomic_load_n(&stats->in_flight, __ATOMIC_RELAXED),
+            reads ? histogram_percentile(&stats->reads, reads, 99) / 1e6 : 0.0,
+            writes ? histogram_percentile(&stats->writes, writes, 99) / 1e6 : 0.0, submit, wait);
+}
+
+static void print_histogram_json(FILE *out, const char *name, const struct latency_histogram *histogram)
+{
+    uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    uint64_t sum = __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED);
+    int first = 1;
+
+    fprintf(out, "  \"%s\": {\"count\": %llu, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+            "\"p999_us\": %.3f, \"max_us\": %.3f,\n    \"buckets\": [", name, (unsigned long long)count,
+            count ? sum / 1e3 / count : 0.0,
+            count ? histogram_percentile(histogram, count, 50) / 1e3 : 0.0,
+            count ? histogram_percentile(histogram, count, 90) / 1e3 : 0.0,
+            count ? histogram_percentile(histogram, count, 99) / 1e3 : 0.0,
+            count ? histogram_percentile(histogram, count, 99.9) / 1e3 : 0.0,
+            __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED) / 1e3);
+    // Only the buckets that were hit, as [upper bound in us, count].
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        uint64_t hits = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        if (hits == 0) continue;
+        fprintf(out, "%s[%.3f, %llu]", first ? "" : ", ", histogram_bucket_limit(i) / 1e3, (unsigned long long)hits);
+        first = 0;
+    }
+    fprintf(out, "]}");
+}
+
+void acopy_stats_print_json(FILE *out, struct acopy_stats *stats)
+{
+    double elapsed = stats_elapsed_ns(stats) / 1e9;
+    uint64_t done = __atomic_load_n(&stats->bytes_done, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&stats->lock);
+    fprintf(out, "{\n  \"elapsed\": %f,\n  \"bytes\": %llu,\n  \"bytes_total\": %llu,\n  \"throughput_mb_s\": %.3f,\n"
+            "  \"window_mb_s\": %.3f,\n  \"in_flight\": %lld,\n  \"max_depth\": %lld,\n  \"submit_seconds\": %f,\n  \"wait_seconds\": %f,\n",
+            elapsed, (unsigned long long)done, (unsigned long long)__atomic_load_n(&stats->bytes_total, __ATOMIC_RELAXED),
+            elapsed > 0 ? done / elapsed / (1024 * 1024) : 0.0, stats_window_rate(stats) / (1024 * 1024),
+            (long long)__atomic_load_n(&stats->in_flight, __ATOMIC_RELAXED),
+            (long long)__atomic_load_n(&stats->max_depth, __ATOMIC_RELAXED),
+            __atomic_load_n(&stats->submit_ns, __ATOMIC_RELAXED) / 1e9, __atomic_load_n(&stats->wait_ns, __ATOMIC_RELAXED) / 1e9);
+    print_histogram_json(out, "reads", &stats->reads);
+    fprintf(out, ",\n");
+    print_histogram_json(out, "writes", &stats->writes);
+    fprintf(out, ",\n  \"series\": [");
+    for (int i = 0; i < stats->series_count; i++)
+    {
+        fprintf(out, "%s\n    {\"t\": %.3f, \"bytes\": %llu, \"depth\": %d}", i ? "," : "", stats->series[i].time_ns / 1e9,
+                (unsigned long long)stats->series[i].bytes, stats->series[i].depth);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    pthread_mutex_unlock(&stats->lock);
+    fflush(out);
+}
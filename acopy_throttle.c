@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "acopy_internal.h"
+
+// Bursts the buckets hold: a tenth of a second at the full rate.
+#define THROTTLE_BURST_SECONDS 0.1
+// Longest sleep for tokens, so a rate raised at runtime takes effect soon.
+#define THROTTLE_MAX_SLEEP_NS 100000000L
+// How often the feedback mode looks at the completion latency.
+#define THROTTLE_FEEDBACK_NS 200000000ULL
+// Slowest the feedback mode throttles down to.
+#define THROTTLE_MIN_RATE (1024.0 * 1024)
+
+// -------------------------------------------------------------------------------------------------------
+// Throttle.
+// Two token buckets, bytes and operations, shared by every engine loop and zero-copy thread of a copy.
+// An operation may start while both buckets are not in debt, and then takes its tokens, so a block larger
+// than the burst still goes through and the debt is paid off before the next one. While the buckets
+// allow it, a loop starts as many operations as it has free slots, so a throttled copy keeps its queue as
+// deep as the rate allows instead of trickling one operation at a time.
+// In feedback mode the byte rate is lowered by a quarter whenever the mean completion latency over the last
+// period was above the target, and raised by a tenth while it stays below, up to the configured limit.
+// -------------------------------------------------------------------------------------------------------
+struct acopy_throttle
+{
+    pthread_mutex_t lock;
+    double bytes_limit, ops_limit; // Configured rates, 0 for none.
+    uint64_t target_ns;            // Feedback latency target, 0 for none.
+    double bytes_rate;             // Byte rate in force: the limit, or what the feedback settled on (0 for none).
+    double byte_tokens, op_tokens;
+    uint64_t refilled_ns;
+    // Feedback period.
+    uint64_t period_start_ns;
+    uint64_t period_latency_ns, period_completions, period_bytes;
+};
+
+static uint64_t throttle_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+struct acopy_throttle *acopy_throttle_new(void)
+{
+    struct acopy_throttle *throttle = calloc(1, sizeof(struct acopy_throttle));
+    if (!throttle)
+    {
+        perror("calloc");
+        return NULL;
+    }
+    pthread_mutex_init(&throttle->lock, NULL);
+    return throttle;
+}
+
+void acopy_throttle_free(struct acopy_throttle *throttle)
+{
+    if (!throttle) return;
+    pthread_mutex_destroy(&throttle->lock);
+    free(throttle);
+}
+
+void acopy_throttle_set(struct acopy_throttle *throttle, uint64_t bytes_per_second, uint64_t ops_per_second)
+{
+    pthread_mutex_lock(&throttle->lock);
+    throttle->bytes_limit = bytes_per_second;
+    throttle->ops_limit = ops_per_second;
+    throttle->bytes_rate = bytes_per_second;
+    // Start over with full buckets rather than paying off debt run up under the old rates.
+    throttle->byte_tokens = throttle->bytes_limit * THROTTLE_BURST_SECONDS;
+    throttle->op_tokens = throttle->ops_limit * THROTTLE_BURST_SECONDS;
+    pthread_mutex_unlock(&throttle->lock);
+}
+
+void acopy_throttle_set_target(struct acopy_throttle *throttle, uint64_t target_us)
+{
+    pthread_mutex_lock(&throttle->lock);
+    throttle->target_ns = target_us * 1000;
+    throttle->bytes_rate = throttle->bytes_limit;
+    throttle->period_start_ns = 0;
+    pthread_mutex_unlock(&throttle->lock);
+}
+
+void acopy_throttle_print(FILE *out, struct acopy_throttle *throttle)
+{
+    pthread_mutex_lock(&throttle->lock);
+    fprintf(out, "Throttle: ");
+    if (throttle->bytes_limit > 0) fprintf(out, "%.1f MB/s", throttle->bytes_limit / (1024 * 1024));
+    else fprintf(out, "no byte limit");
+    if (throttle->ops_limit > 0) fprintf(out, ", %.0f ops/s", throttle->ops_limit);
+    if (throttle->target_ns > 0)
+    {
+        fprintf(out, ", latency target %llu us, ", (unsigned long long)(throttle->target_ns / 1000));
+        if (throttle->bytes_rate > 0) fprintf(out, "now %.1f MB/s", throttle->bytes_rate / (1024 * 1024));
+        else fprintf(out, "not backing off");
+    }
+    fprintf(out, "\n");
+    pthread_mutex_unlock(&throttle->lock);
+}
+
+// Feedback: look at the latency of the operations completed since the period started. Called locked.
+static void throttle_feedback(struct acopy_throttle *throttle, struct acopy_stats *stats, uint64_t now)
+{
+    uint64_t completions, bytes;
+    uint64_t latency = stats_totals(stats, &completions, &bytes);
+    if (throttle->period_start_ns == 0 || completions < throttle->period_completions)
+    {
+        // First look, or the stats were swapped out under us.
+        throttle->period_start_ns = now;
+        throttle->period_latency_ns = latency;
+        throttle->period_completions = completions;
+        throttle->period_bytes = bytes;
+        return;
+    }
+    if (now - throttle->period_start_ns < THROTTLE_FEEDBACK_NS || completions == throttle->period_completions) return;
+
+    uint64_t mean_ns = (latency - throttle->period_latency_ns) / (completions - throttle->period_completions);
+    double observed = (bytes - throttle->period_bytes) * 1e9 / (now - throttle->period_start_ns);
+    if (mean_ns > throttle->target_ns)
+    {
+        // Back off from whichever is lower, the rate in force or what actually got through.
+        double rate = (throttle->bytes_rate > 0 && throttle->bytes_rate < observed) ? throttle->bytes_rate : observed;
+        throttle->bytes_rate = rate * 0.75;
+        if (throttle->bytes_rate < THROTTLE_MIN_RATE) throttle->bytes_rate = THROTTLE_MIN_RATE;
+    }
+    else if (throttle->bytes_rate > 0)
+    {
+        throttle->bytes_rate *= 1.1;
+        // Without a limit, a rate well above what gets through no longer holds anything back.
+        if (throttle->bytes_limit > 0 && throttle->bytes_rate > throttle->bytes_limit) throttle->bytes_rate = throttle->bytes_limit;
+        if (throttle->bytes_limit == 0 && throttle->bytes_rate > 2 * observed) throttle->bytes_rate = 0;
+    }
+    throttle->period_start_ns = now;
+    throttle->period_latency_ns = latency;
+    throttle->period_completions = completions;
+    throttle->period_bytes = bytes;
+}
+
+// 1 when the next operation may start. With wait set it sleeps until then, otherwise it returns 0 at once.
+int throttle_ready(struct acopy_throttle *throttle, struct acopy_stats *stats, int wait)
+{
+    if (!throttle) return 1;
+    for (;;)
+    {
+        pthread_mutex_lock(&throttle->lock);
+        uint64_t now = throttle_clock();
+        if (throttle->target_ns > 0 && stats) throttle_feedback(throttle, stats, now);
+        double elapsed = (throttle->refilled_ns ? now - throttle->refilled_ns : 0) / 1e9;
+        throttle->refilled_ns = now;
+        throttle->byte_tokens += throttle->bytes_rate * elapsed;
+        throttle->op_tokens += throttle->ops_limit * elapsed;
+        if (throttle->byte_tokens > throttle->bytes_rate * THROTTLE_BURST_SECONDS) throttle->byte_tokens = throttle->bytes_rate * THROTTLE_BURST_SECONDS;
+        if (throttle->op_tokens > throttle->ops_limit * THROTTLE_BURST_SECONDS) throttle->op_tokens = throttle->ops_limit * THROTTLE_BURST_SECONDS;
+
+        // Time until both buckets are out of debt.
+        double sleep = 0;
+        if (throttle->bytes_rate > 0 && throttle->byte_tokens < 0) sleep = -throttle->byte_tokens / throttle->bytes_rate;
+        if (throttle->ops_limit > 0 && throttle->op_tokens < 0 && -throttle->op_tokens / throttle->ops_limit > sleep) sleep = -throttle->op_tokens / throttle->ops_limit;
+        pthread_mutex_unlock(&throttle->lock);
+        if (sleep == 0) return 1;
+        if (!wait) return 0;
+
+        long sleep_ns = (sleep * 1e9 < THROTTLE_MAX_SLEEP_NS) ? (long)(sleep * 1e9) + 1 : THROTTLE_MAX_SLEEP_NS;
+        struct timespec pause = {0, sleep_ns};
+        nanosleep(&pause, NULL);
+    }
+}
+
+// Take the tokens of an operation that is starting.
+void throttle_charge(struct acopy_throttle *throttle, size_t bytes)
+{
+    if (!throttle) return;
+    pthread_mutex_lock(&throttle->lock);
+    if (throttle->bytes_rate > 0) throttle->byte_tokens -= bytes;
+    if (throttle->ops_limit > 0) throttle->op_tokens -= 1;
+    pthread_mutex_unlock(&throttle->lock);
+}
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fts.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "acopy_internal.h"
+
+// Files a tree copy keeps open ahead of the data I/O.
+#define MAX_OPEN_FILES 256
+
+// -------------------------------------------------------------------------------------------------------
+// Directory tree copy.
+// A walker thread runs ahead of the data I/O: it creates directories and symlinks, opens and stats
+// files, and queues them. The engine loop pulls blocks from the head of the queue, so the slots are
+// spread over many small files at once and a large file is split across all of them. A file is
+// closed, and gets its mode bits and times, once its last block is written.
+// -------------------------------------------------------------------------------------------------------
+struct tree_file
+{
+    struct tree_file *next;    // Next file in the queue.
+    int source_fd, destination_fd;
+    struct stat st;            // Source metadata applied when the copy is done.
+    off_t next_offset;         // First byte not handed to the engine yet.
+    int blocks_in_flight;
+    int failed;
+    char *path;                // Destination path, for error messages.
+};
+
+struct tree_dir
+{
+    struct tree_dir *next;
+    struct stat st;
+    char *path;
+};
+
+struct tree_feeder
+{
+    struct block_feeder base;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;      // A file was queued or the walk ended.
+    pthread_cond_t room;       // An open file was finished or the copy was aborted.
+    struct tree_file *head, *tail; // Files with blocks not handed out yet.
+    int open_files;            // Files opened and not finished yet.
+    int walk_done;
+    int aborted;
+    size_t block_size;
+    int open_flags;            // Extra flags for the destination files.
+    const struct acopy_opts *opts;
+    const char *source_root;
+    const char *destination_root;
+    struct tree_dir *dirs;     // Created directories, deepest last created first.
+    off_t bytes;
+    long files, directories, failures;
+};
+
+static void tree_file_finish(struct tree_feeder *feeder, struct tree_file *file)
+{
+    if (!file->failed)
+    {
+        // The mode is applied last so read-only files can still be written while in flight.
+        struct timespec times[2] = {file->st.st_atim, file->st.st_mtim};
+        if (fchmod(file->destination_fd, file->st.st_mode & 07777) == -1 || futimens(file->destination_fd, times) == -1)
+        {
+            fprintf(stderr, "%s: %s\n", file->path, strerror(errno));
+            file->failed = 1;
+        }
+    }
+    if (file->failed) feeder->failures++;
+    else feeder->files++;
+    close(file->source_fd);
+    close(file->destination_fd);
+    free(file->path);
+    free(file);
+    feeder->open_files--;
+    pthread_cond_signal(&feeder->room);
+}
+
+static int tree_feeder_next(struct block_feeder *base, struct copy_block *block, int wait)
+{
+    struct tree_feeder *feeder = (struct tree_feeder *)base;
+    int ret = 0;
+
+    pthread_mutex_lock(&feeder->lock);
+    for (;;)
+    {
+        struct tree_file *file = feeder->head;
+        if (!file)
+        {
+            if (feeder->walk_done || feeder->aborted)
+            {
+                ret = -1;
+                break;
+            }
+            if (!wait) break;
+            pthread_cond_wait(&feeder->ready, &feeder->lock);
+            continue;
+        }
+        if (file->next_offset < file->st.st_size)
+        {
+            block->source_fd = file->source_fd;
+            block->destination_fd = file->destination_fd;
+            block->offset = file->next_offset;
+            block->length = (file->st.st_size - file->next_offset < (off_t)feeder->block_size) ? (size_t)(file->st.st_size - file->next_offset) : feeder->block_size;
+            block->owner = file;
+            file->next_offset += block->length;
+            file->blocks_in_flight++;
+            ret = 1;
+        }
+        if (file->next_offset >= file->st.st_size)
+        {
+            // Every block of the file has been handed out.
+            feeder->head = file->next;
+            if (!feeder->head) feeder->tail = NULL;
+            if (file->blocks_in_flight == 0) tree_file_finish(feeder, file); // Empty file.
+        }
+        if (ret == 1) break;
+    }
+    pthread_mutex_unlock(&feeder->lock);
+    return ret;
+}
+
+static void tree_feeder_done(struct block_feeder *base, struct copy_block *block, int status)
+{
+    struct tree_feeder *feeder = (struct tree_feeder *)base;
+    struct tree_file *file = block->owner;
+
+    pthread_mutex_lock(&feeder->lock);
+    file->blocks_in_flight--;
+    if (status == -1) file->failed = 1;
+    else feeder->bytes += block->length;
+    if (file->blocks_in_flight == 0 && file->next_offset >= file->st.st_size) tree_file_finish(feeder, file);
+    pthread_mutex_unlock(&feeder->lock);
+}
+
+// Count an entry that could not be copied; the engine thread counts failed files too.
+static void tree_failure(struct tree_feeder *feeder)
+{
+    pthread_mutex_lock(&feeder->lock);
+    feeder->failures++;
+    pthread_mutex_unlock(&feeder->lock);
+}
+
+// Open a source file and its destination and queue them for the engine.
+static void tree_queue_file(struct tree_feeder *feeder, const char *source, const char *destination)
+{
+    struct tree_file *file = calloc(1, sizeof(struct tree_file));
+    if (!file) return;
+    file->source_fd = open(source, O_RDONLY | O_CLOEXEC);
+    if (file->source_fd == -1 || fstat(file->source_fd, &file->st) == -1)
+    {
+        fprintf(stderr, "%s: %s\n", source, strerror(errno));
+        goto fail;
+    }
+    file->destination_fd = open(destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | feeder->open_flags, 0600);
+    if (file->destination_fd == -1)
+    {
+        fprintf(stderr, "%s: %s\n", destination, strerror(errno));
+        goto fail;
+    }
+    if (prepare_destination(file->destination_fd, file->st.st_size, feeder->opts) == -1)
+    {
+        fprintf(stderr, "%s: could not lay out the file\n", destination);
+        close(file->destination_fd);
+        goto fail;
+    }
+    file->path = strdup(destination);
+    stats_begin(feeder->base.stats, file->st.st_size);
+
+    pthread_mutex_lock(&feeder->lock);
+    while (feeder->open_files >= MAX_OPEN_FILES && !feeder->aborted) pthread_cond_wait(&feeder->room, &feeder->lock);
+    if (feeder->aborted)
+    {
+        pthread_mutex_unlock(&feeder->lock);
+        close(file->destination_fd);
+        free(file->path);
+        goto fail;
+    }
+    feeder->open_files++;
+    if (feeder->tail) feeder->tail->next = file;
+    else feeder->head = file;
+    feeder->tail = file;
+    pthread_cond_signal(&feeder->ready);
+    pthread_mutex_unlock(&feeder->lock);
+    return;
+
+fail:
+    if (file->source_fd != -1) close(file->source_fd);
+    free(file);
+    tree_failure(feeder);
+}
+
+static void *tree_walker_main(void *arg)
+{
+    struct tree_feeder *feeder = arg;
+    char *roots[] = {(char *)feeder->source_root, NULL};
+    size_t root_length = strlen(feeder->source_root);
+    FTS *fts = fts_open(roots, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+    FTSENT *entry;
+
+    if (!fts)
+    {
+        perror("fts_open");
+        tree_failure(feeder);
+    }
+    while (fts && (entry = fts_read(fts)) != NULL)
+    {
+        if (__atomic_load_n(&feeder->aborted, __ATOMIC_RELAXED)) break;
+        char destination[PATH_MAX];
+        if (snprintf(destination, sizeof(destination), "%s%s", feeder->destination_root, entry->fts_path + root_length) >= (int)sizeof(destination))
+        {
+            fprintf(stderr, "%s: path too long\n", entry->fts_path);
+            tree_failure(feeder);
+            continue;
+        }
+
+        switch (entry->fts_info)
+        {
+        case FTS_D:
+            // Owner-writable until the end, so the files inside can be created.
+            if (mkdir(destination, 0700) == -1 && errno != EEXIST)
+            {
+                fprintf(stderr, "%s: %s\n", destination, strerror(errno));
+                tree_failure(feeder);
+                fts_set(fts, entry, FTS_SKIP);
+                break;
+            }
+            struct tree_dir *dir = malloc(sizeof(struct tree_dir));
+            if (dir)
+            {
+                dir->st = *entry->fts_statp;
+                dir->path = strdup(destination);
+                dir->next = feeder->dirs;
+                feeder->dirs = dir;
+            }
+            feeder->directories++;
+            break;
+        case FTS_F:
+            tree_queue_file(feeder, entry->fts_path, destination);
+            break;
+        case FTS_SL:
+        case FTS_SLNONE:
+        {
+            char target[PATH_MAX];
+            ssize_t length = readlink(entry->fts_path, target, sizeof(target) - 1);
+            if (length == -1 || (target[length] = '\0', symlink(target, destination) == -1))
+            {
+                fprintf(stderr, "%s: %s\n", destination, strerror(errno));
+                tree_failure(feeder);
+                break;
+            }
+            struct timespec times[2] = {entry->fts_statp->st_atim, entry->fts_statp->st_mtim};
+            utimensat(AT_FDCWD, destination, times, AT_SYMLINK_NOFOLLOW);
+            break;
+        }
+        case FTS_DP:
+            break;
+        case FTS_DNR:
+        case FTS_ERR:
+        case FTS_NS:
+            fprintf(stderr, "%s: %s\n", entry->fts_path, strerror(entry->fts_errno));
+            tree_failure(feeder);
+            break;
+        default:
+            fprintf(stderr, "%s: not a regular file, directory or symlink, skipped\n", entry->fts_path);
+            break;
+        }
+    }
+    if (fts) fts_close(fts);
+    pthread_mutex_lock(&feeder->lock);
+    feeder->walk_done = 1;
+    pthread_cond_signal(&feeder->ready);
+    pthread_mutex_unlock(&feeder->lock);
+    return NULL;
+}
+
+int acopy_tree(struct acopy_ctx *ctx, const char *source_path, const char *destination_path, const struct acopy_opts *opts, struct acopy_report *report)
+{
+    struct tree_feeder feeder;
+    pthread_t walker;
+    sigset_t all, old;
+    struct timespec start, finish;
+    struct rusage usage_start, usage_finish;
+    struct stat source_stat, destination_stat;
+    struct acopy_opts resolved; // opts with HDD mode settled
+    int status;
+
+    memset(report, 0, sizeof(*report));
+    report->engine = opts->engine;
+    if (opts->engine != ACOPY_ENGINE_POSIX_AIO && opts->engine != ACOPY_ENGINE_IO_URING)
+    {
+        fprintf(stderr, "Tree copies run on the posix-aio or io_uring engine\n");
+        return -1;
+    }
+    if (opts->engine == ACOPY_ENGINE_POSIX_AIO) aio_configure(opts);
+    if (opts->auto_tune || opts->sparse || opts->verify != ACOPY_VERIFY_NONE || opts->resume || opts->durability == ACOPY_DURABILITY_WRITEBEHIND ||
+        opts->compress != ACOPY_CODEC_NONE || opts->decompress || opts->direct || opts->threads > 1)
+    {
+        // The walker opens files through the page cache and feeds one shared queue.
+        fprintf(stderr, "Auto-tuning, sparse copies, verification, resuming, write-behind, compression, direct I/O and multiple threads "
+                        "are not supported for tree copies\n");
+        return -1;
+    }
+    // The destination root may not exist yet; then only the source decides.
+    if (stat(source_path, &source_stat) == -1)
+    {
+        perror(source_path);
+        return -1;
+    }
+    if (stat(destination_path, &destination_stat) == -1) destination_stat.st_dev = source_stat.st_dev;
+    report->hdd = hdd_mode(opts, source_stat.st_dev, destination_stat.st_dev);
+    hdd_opts(&resolved, opts, report->hdd);
+    opts = &resolved;
+    char *buffer = ctx_buffer(ctx, 2 * opts->block_size * opts->num_async_ops, sizeof(void *), opts->huge_pages);
+    if (!buffer) return -1;
+
+    memset(&feeder, 0, sizeof(feeder));
+    feeder.base.next = tree_feeder_next;
+    feeder.base.done = tree_feeder_done;
+    feeder.base.stats = opts->stats;
+    feeder.base.ordered = opts->ordered_writes;
+    feeder.base.sequential = (opts->hdd == ACOPY_HDD_ON);
+    feeder.base.throttle = opts->throttle;
+    pthread_mutex_init(&feeder.lock, NULL);
+    pthread_cond_init(&feeder.ready, NULL);
+    pthread_cond_init(&feeder.room, NULL);
+    feeder.block_size = opts->block_size;
+    feeder.opts = opts;
+    feeder.open_flags = (opts->durability == ACOPY_DURABILITY_DSYNC) ? O_DSYNC : 0;
+    feeder.source_root = source_path;
+    feeder.destination_root = destination_path;
+
+    getrusage(RUSAGE_SELF, &usage_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stats_begin(opts->stats, 0);
+    // The walker must not take the completion signals the copy loop waits for.
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    errno = pthread_create(&walker, NULL, tree_walker_main, &feeder);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (errno != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
+    if (opts->engine == ACOPY_ENGINE_IO_URING) status = uring_copy_loop(&feeder.base, buffer, opts->block_size, opts->num_async_ops);
+    else status = aio_copy_loop(&feeder.base, buffer, opts->block_size, opts->num_async_ops, opts->completion);
+
+    // On failure stop the walker and close whatever it already queued.
+    pthread_mutex_lock(&feeder.lock);
+    feeder.aborted = 1;
+    pthread_cond_broadcast(&feeder.room);
+    pthread_mutex_unlock(&feeder.lock);
+    pthread_join(walker, NULL);
+    while (feeder.head)
+    {
+        struct tree_file *file = feeder.head;
+        feeder.head = file->next;
+        file->failed = 1;
+        if (file->blocks_in_flight == 0) tree_file_finish(&feeder, file);
+    }
+
+    // Directories get their mode and times last, deepest first, after everything inside them is written.
+    while (feeder.dirs)
+    {
+        struct tree_dir *dir = feeder.dirs;
+        struct timespec times[2] = {dir->st.st_atim, dir->st.st_mtim};
+        if (dir->path && (chmod(dir->path, dir->st.st_mode & 07777) == -1 || utimensat(AT_FDCWD, dir->path, times, 0) == -1))
+        {
+            fprintf(stderr, "%s: %s\n", dir->path, strerror(errno));
+            feeder.failures++;
+        }
+        feeder.dirs = dir->next;
+        free(dir->path);
+        free(dir);
+    }
+    if (opts->durability == ACOPY_DURABILITY_END)
+    {
+        // One syncfs() flushes every file of the tree instead of one fdatasync() per file.
+        struct timespec flush_start, flush_finish;
+        clock_gettime(CLOCK_MONOTONIC, &flush_start);
+        int root_fd = open(destination_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (root_fd == -1 || syncfs(root_fd) == -1)
+        {
+            fprintf(stderr, "%s: %s\n", destination_path, strerror(errno));
+            feeder.failures++;
+        }
+        if (root_fd != -1) close(root_fd);
+        clock_gettime(CLOCK_MONOTONIC, &flush_finish);
+        report->flush_elapsed = timespec_diff(&flush_start, &flush_finish);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    getrusage(RUSAGE_SELF, &usage_finish);
+
+    report->bytes = feeder.bytes;
+    report->files = feeder.files;
+    report->directories = feeder.directories;
+    report->failures = feeder.failures;
+    report->elapsed = timespec_diff(&start, &finish);
+    report->cpu_user = timeval_diff(&usage_start.ru_utime, &usage_finish.ru_utime);
+    report->cpu_sys = timeval_diff(&usage_start.ru_stime, &usage_finish.ru_stime);
+
+    pthread_mutex_destroy(&feeder.lock);
+    pthread_cond_destroy(&feeder.ready);
+    pthread_cond_destroy(&feeder.room);
+    return (status == -1 || feeder.failures > 0) ? -1 : 0;
+}
+
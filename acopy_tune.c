@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "acopy_internal.h"
+
+// Smallest and largest block size the tuner tries.
+#define TUNE_MIN_BLOCK_SIZE (4 * 1024)
+#define TUNE_MAX_BLOCK_SIZE (8 * 1024 * 1024)
+// A window must be at least this long to give a usable rate; shorter windows are doubled.
+#define TUNE_MIN_WINDOW_BYTES (16 * 1024 * 1024)
+#define TUNE_MAX_WINDOW_BYTES (1024 * 1024 * 1024)
+#define TUNE_MIN_WINDOW_SECONDS 0.05
+// A neighbour has to beat the current point by this factor, so measurement noise does not move it.
+#define TUNE_GAIN 1.05
+
+// -------------------------------------------------------------------------------------------------------
+// Auto-tuning.
+// The copy is split into measurement windows. Every window runs the engine over the next part of the file
+// with one (block size, operations) point and measures its throughput. The tuner hill-climbs: it tries
+// doubling and halving each parameter in turn, moves whenever a neighbour is faster, and settles once no
+// neighbour is. The rest of the file is copied at the settled point, and the point is cached per pair of
+// devices so the next run starts there.
+// -------------------------------------------------------------------------------------------------------
+struct tune_point
+{
+    size_t block_size;
+    int num_async_ops;
+};
+
+// Neighbour of a point in one of four directions: block size up, down, operations up, down.
+static struct tune_point tune_neighbour(struct tune_point point, int direction)
+{
+    if (direction == 0) point.block_size *= 2;
+    else if (direction == 1) point.block_size /= 2;
+    else if (direction == 2) point.num_async_ops *= 2;
+    else point.num_async_ops /= 2;
+    if (point.num_async_ops > ACOPY_MAX_IO_OPERATIONS) point.num_async_ops = ACOPY_MAX_IO_OPERATIONS;
+    return point;
+}
+
+static int tune_point_valid(struct tune_point point, size_t alignment, const struct acopy_opts *opts)
+{
+    if (point.block_size < TUNE_MIN_BLOCK_SIZE || point.block_size > TUNE_MAX_BLOCK_SIZE) return 0;
+    if (point.num_async_ops < 1) return 0;
+    if (opts->direct && point.block_size % alignment != 0) return 0;
+    return 2 * point.block_size * point.num_async_ops <= opts->memory_cap;
+}
+
+// Cache file: one line per device pair, "source_dev destination_dev engine direct block_size operations".
+static void tune_cache_path(char *path, size_t size)
+{
+    const char *env = getenv("ACOPY_TUNE_CACHE");
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (env && *env) snprintf(path, size, "%s", env);
+    else if (cache_home && *cache_home) snprintf(path, size, "%s/acopy-tune", cache_home);
+    else if (home && *home) snprintf(path, size, "%s/.cache/acopy-tune", home);
+    else snprintf(path, size, "/tmp/acopy-tune-%d", (int)getuid());
+}
+
+static int tune_cache_load(const char *path, const char *key, struct tune_point *point)
+{
+    char line[256];
+    size_t key_length = strlen(key);
+    int found = 0;
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned long long block_size;
+        int num_async_ops;
+        if (strncmp(line, key, key_length) != 0 || line[key_length] != ' ') continue;
+        if (sscanf(line + key_length, "%llu %d", &block_size, &num_async_ops) != 2) continue;
+        point->block_size = block_size;
+        point->num_async_ops = num_async_ops;
+        found = 1;
+    }
+    fclose(file);
+    return found;
+}
+
+// Rewrite the cache with this key's line replaced; the rename keeps concurrent readers consistent.
+static void tune_cache_store(const char *path, const char *key, struct tune_point point)
+{
+    char temporary[PATH_MAX + 16];
+    char line[256];
+    size_t key_length = strlen(key);
+    FILE *in, *out;
+
+    snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid());
+    out = fopen(temporary, "w");
+    if (!out)
+    {
+        // Create ~/.cache on first use; a missing cache only costs the head start.
+        char directory[PATH_MAX];
+        char *slash;
+        snprintf(directory, sizeof(directory), "%s", path);
+        slash = strrchr(directory, '/');
+        if (!slash) return;
+        *slash = '\0';
+        if (mkdir(directory, 0755) == -1 && errno != EEXIST) return;
+        out = fopen(temporary, "w");
+        if (!out) return;
+    }
+    in = fopen(path, "r");
+    if (in)
+    {
+        while (fgets(line, sizeof(line), in))
+        {
+            if (strncmp(line, key, key_length) == 0 && line[key_length] == ' ') continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s %zu %d\n", key, point.block_size, point.num_async_ops);
+    if (fclose(out) != 0 || rename(temporary, path) == -1) unlink(temporary);
+}
+
+// Copy [offset, offset + length) at one point and return its throughput in bytes per second, -1 on failure.
+static double tune_window(struct acopy_ctx *ctx, enum acopy_engine engine, int source_fd, int destination_fd, off_t offset, off_t length,
+                          size_t alignment, struct tune_point point, const struct acopy_opts *opts, double *elapsed)
+{
+    struct acopy_opts window_opts = *opts;
+    struct block_range range = {offset, offset + length, point.block_size};
+    struct timespec start, finish;
+    // The pool only grows when a point needs more than any earlier one.
+    char *buffer = ctx_buffer(ctx, 2 * point.block_size * point.num_async_ops, alignment, opts->huge_pages);
+    if (!buffer) return -1;
+
+    window_opts.block_size = point.block_size;
+    window_opts.num_async_ops = point.num_async_ops;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (copy_range(engine, source_fd, destination_fd, &range, buffer, &window_opts, NULL) == -1) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    *elapsed = timespec_diff(&start, &finish);
+    return *elapsed > 0 ? length / *elapsed : 0;
+}
+
+int copy_auto_tuned(struct acopy_ctx *ctx, enum acopy_engine engine, int source_fd, int destination_fd, off_t total_size, size_t alignment, const struct acopy_opts *opts, struct acopy_report *report)
+{
+    struct tune_point best = {opts->block_size, opts->num_async_ops};
+    struct tune_point cached;
+    struct stat source_stat, destination_stat;
+    char path[PATH_MAX];
+    char key[128];
+    double best_rate = -1;
+    off_t window_bytes = TUNE_MIN_WINDOW_BYTES;
+    off_t offset = 0;
+    int direction = 0;
+    int failures = 0;
+    int settled = 0;
+    int moved = 0;
+
+    if (fstat(source_fd, &source_stat) == -1 || fstat(destination_fd, &destination_stat) == -1)
+    {
+        perror("fstat");
+        return -1;
+    }
+    snprintf(key, sizeof(key), "%ju %ju %s %d", (uintmax_t)source_stat.st_dev, (uintmax_t)destination_stat.st_dev,
+             acopy_engine_name(engine), opts->direct);
+    tune_cache_path(path, sizeof(path));
+    if (tune_cache_load(path, key, &cached) && tune_point_valid(cached, alignment, opts)) best = cached;
+
+    while (offset < total_size)
+    {
+        struct tune_point point = best;
+        double rate, elapsed;
+        off_t length;
+
+        // First measure where we stand, then try the neighbours one at a time until none is better.
+        if (best_rate >= 0 && !settled)
+        {
+            while (failures < 4)
+            {
+                point = tune_neighbour(best, direction);
+                if (tune_point_valid(point, alignment, opts) &&
+                    (point.block_size != best.block_size || point.num_async_ops != best.num_async_ops)) break;
+                failures++;
+                direction = (direction + 1) % 4;
+            }
+            if (failures == 4)
+            {
+                settled = 1;
+                point = best;
+            }
+        }
+
+        // Once settled, the rest of the file goes in one run without draining the queue again.
+        length = settled ? total_size - offset : window_bytes;
+        if (length < (off_t)point.block_size * point.num_async_ops * 8) length = (off_t)point.block_size * point.num_async_ops * 8;
+        length -= length % point.block_size;
+        if (length <= 0 || length > total_size - offset) length = total_size - offset;
+
+        rate = tune_window(ctx, engine, source_fd, destination_fd, offset, length, alignment, point, opts, &elapsed);
+        if (rate < 0) return -1;
+        offset += length;
+        report->tune_windows++;
+        if (elapsed < TUNE_MIN_WINDOW_SECONDS && window_bytes < TUNE_MAX_WINDOW_BYTES) window_bytes *= 2;
+
+        if (settled) continue;
+        if (best_rate < 0)
+        {
+            best_rate = rate;
+        }
+        else if (rate > best_rate * TUNE_GAIN)
+        {
+            // Keep going the same way while it pays off.
+            best = point;
+            best_rate = rate;
+            failures = 0;
+            moved = 1;
+        }
+        else
+        {
+            failures++;
+            direction = (direction + 1) % 4;
+        }
+    }
+
+    report->tuned_block_size = best.block_size;
+    report->tuned_num_async_ops = best.num_async_ops;
+    report->tune_settled = settled;
+    if (settled || moved) tune_cache_store(path, key, best);
+    return 0;
+}
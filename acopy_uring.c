@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "acopy_internal.h"
+
+// -------------------------------------------------------------------------------------------------------
+// Minimal io_uring ring: the SQ/CQ rings and the SQE array mapped from the kernel.
+// glibc has no wrappers and liburing is not required, so the raw syscalls are used.
+// -------------------------------------------------------------------------------------------------------
+struct uring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;           // Local SQ tail, published to the kernel on submit.
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    struct acopy_stats *stats;   // Depth accounting for the queued SQEs, NULL for none.
+};
+
+static int uring_setup(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        // SQ and CQ rings share one mapping, so map the larger of the two sizes.
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) goto fail;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+
+    ring->sq_head  = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head  = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+
+fail:
+    {
+        int saved_errno = errno;
+        if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+static void uring_teardown(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Grab the next free SQE, or NULL if the submission queue is full.
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) return NULL;
+
+    unsigned index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Publish every queued SQE in one batch and wait for at least min_complete completions.
+static int uring_submit_and_wait(struct uring *ring, unsigned min_complete)
+{
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    for (;;)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) return ret;
+        if (errno != EINTR) return -1;
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Copy loop built on io_uring.
+// Each block is queued as a read linked (IOSQE_IO_LINK) to the write of the same buffer, so the kernel
+// starts the write as soon as the read is done. A short read breaks the link; the write then completes
+// with -ECANCELED and the remainder is requeued once the slot has no more SQEs in flight.
+// -------------------------------------------------------------------------------------------------------
+struct uring_slot
+{
+    struct copy_block block;
+    size_t read_done;   // Bytes of the block already read into the buffer.
+    size_t write_done;  // Bytes of the block already written out.
+    int inflight;       // SQEs of this slot still owned by the kernel.
+    int busy;           // The slot holds a block that is not fully written yet.
+    uint64_t sequence;  // Position of the block in hand-out order, for ordered writes.
+    uint64_t submitted_ns; // When the slot's current chain was queued, for the latency histograms.
+    struct hash_job hash;  // Digest of the block, taken while the kernel writes it.
+};
+
+#define URING_WRITE_FLAG 1ULL
+
+static int uring_queue_read(struct uring *ring, struct uring_slot *slot, int index, char *buf, int link)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->block.source_fd;
+    sqe->addr = (unsigned long)(buf + slot->read_done);
+    sqe->len = slot->block.length - slot->read_done;
+    sqe->off = slot->block.offset + slot->read_done;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data = (unsigned long long)index << 1;
+    slot->inflight++;
+    stats_depth(ring->stats, 1);
+    return 0;
+}
+
+static int uring_queue_write(struct uring *ring, struct uring_slot *slot, int index, char *buf)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = slot->block.destination_fd;
+    sqe->addr = (unsigned long)(buf + slot->write_done);
+    sqe->len = slot->block.length - slot->write_done;
+    sqe->off = slot->block.offset + slot->write_done;
+    sqe->user_data = ((unsigned long long)index << 1) | URING_WRITE_FLAG;
+    slot->inflight++;
+    stats_depth(ring->stats, 1);
+    return 0;
+}
+
+int uring_copy_loop(struct block_feeder *feeder, char *buffer, size_t block_size, int num_async_ops)
+{
+    struct uring ring;
+    struct uring_slot *slots;
+    int *order; // Ordered writes: the slot of every block handed out, by sequence modulo the slot count.
+    int feeder_finished = 0;
+    int active = 0;
+    int status = 0;
+    struct acopy_stats *stats = feeder->stats;
+    struct block_hasher hasher, *hashing = NULL;
+    int ordered = feeder->ordered;
+    int read_depth = feeder->sequential ? 1 : num_async_ops;
+    int reads_in_flight = 0;
+    uint64_t handed_out = 0, next_write = 0; // Ordered writes: blocks handed out, and the next one to write.
+
+    // Every slot can have a read and its linked write queued at the same time.
+    if (uring_setup(&ring, 2 * num_async_ops) == -1)
+    {
+        perror("io_uring_setup");
+        return -1;
+    }
+    slots = calloc(num_async_ops, sizeof(struct uring_slot));
+    order = calloc(num_async_ops, sizeof(int));
+    if (!slots || !order)
+    {
+        perror("calloc");
+        free(slots);
+        free(order);
+        uring_teardown(&ring);
+        return -1;
+    }
+    if (feeder->digests)
+    {
+        if (hasher_start(&hasher, feeder->digests) == -1)
+        {
+            free(slots);
+            free(order);
+            uring_teardown(&ring);
+            return -1;
+        }
+        hashing = &hasher;
+    }
+    ring.stats = stats;
+
+    for (;;)
+    {
+        // Refill every idle slot with the next block, then submit the whole batch with one syscall.
+        uint64_t submit_start = stats_clock(stats);
+        // Ordered writes: the reads are not linked to their writes, and a block that is read is written
+        // once every block handed out before it has been.
+        // Every block from next_write on still holds its slot, so the ring cannot have wrapped over it.
+        while (ordered && next_write < handed_out)
+        {
+            int i = order[next_write % num_async_ops];
+            struct uring_slot *slot = &slots[i];
+            if (slot->inflight > 0 || slot->read_done < slot->block.length) break;
+            next_write++;
+            if (slot->write_done < slot->block.length)
+            {
+                uring_queue_write(&ring, slot, i, buffer + (i * block_size));
+                slot->submitted_ns = stats_clock(stats);
+            }
+        }
+        for (int i = 0; i < num_async_ops; i++)
+        {
+            struct uring_slot *slot = &slots[i];
+            char *buf = buffer + (i * block_size);
+            if (slot->inflight > 0) continue;
+            if (ordered && slot->busy && slot->sequence >= next_write && slot->read_done == slot->block.length) continue; // Waiting for its turn.
+
+            if (slot->busy)
+            {
+                // The slot's chain finished without writing the whole block: requeue the remainder.
+                if (slot->read_done < slot->block.length)
+                {
+                    uring_queue_read(&ring, slot, i, buf, !ordered);
+                    reads_in_flight++;
+                    if (!ordered) uring_queue_write(&ring, slot, i, buf);
+                    slot->submitted_ns = stats_clock(stats);
+                }
+                else if (slot->write_done < slot->block.length)
+                {
+                    uring_queue_write(&ring, slot, i, buf);
+                    slot->submitted_ns = stats_clock(stats);
+                }
+                else
+                {
+                    hasher_wait(hashing, &slot->hash);
+                    feeder_done(feeder, &slot->block, 0);
+                    slot->busy = 0;
+                    active--;
+                }
+            }
+            if (!slot->busy && !feeder_finished && reads_in_flight < read_depth)
+            {
+                // Only block for new work when nothing is in flight that could wake us up instead.
+                int got = feeder_next(feeder, &slot->block, active == 0);
+                if (got == -1) feeder_finished = 1;
+                if (got != 1) continue;
+                slot->read_done = 0;
+                slot->write_done = 0;
+                slot->busy = 1;
+                slot->sequence = handed_out++;
+                order[slot->sequence % num_async_ops] = i;
+                active++;
+                uring_queue_read(&ring, slot, i, buf, !ordered);
+                reads_in_flight++;
+                if (!ordered) uring_queue_write(&ring, slot, i, buf);
+                slot->submitted_ns = stats_clock(stats);
+            }
+        }
+        stats_submit(stats, submit_start);
+        if (active == 0)
+        {
+            if (feeder_finished) break;
+            continue;
+        }
+
+        // One io_uring_enter both submits and waits; it is counted as waiting.
+        uint64_t wait_start = stats_clock(stats);
+        if (uring_submit_and_wait(&ring, 1) == -1)
+        {
+            perror("io_uring_enter");
+            status = -1;
+            break;
+        }
+        stats_wait(stats, wait_start);
+
+        // Drain the completion queue.
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int index = cqe->user_data >> 1;
+            struct uring_slot *slot = &slots[index];
+            int res = cqe->res;
+            slot->inflight--;
+            stats_depth(stats, -1);
+
+            if (res == -ECANCELED) continue; // Linked write dropped after a short read.
+            // A write's latency covers its whole read->write chain, which the kernel runs without us.
+            stats_latency(stats, (cqe->user_data & URING_WRITE_FLAG) != 0, slot->submitted_ns);
+            if (res < 0)
+            {
+                errno = -res;
+                perror((cqe->user_data & URING_WRITE_FLAG) ? "io_uring write" : "io_uring read");
+                status = -1;
+            }
+            else if (cqe->user_data & URING_WRITE_FLAG)
+            {
+                stats_bytes(stats, res);
+                slot->write_done += res;
+            }
+            else
+            {
+                reads_in_flight--;
+                // A short read of 0 means the source shrank under us: only write what was actually read.
+                if (res == 0) slot->block.length = slot->read_done;
+                slot->read_done += res;
+                // The whole block is in the buffer; the linked write may already be running.
+                if (slot->read_done == slot->block.length) hasher_push_block(hashing, &slot->hash, buffer + (index * block_size), &slot->block);
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        if (status == -1) break;
+    }
+
+    if (status == -1)
+    {
+        // Let the kernel finish with our buffers before they are freed.
+        for (;;)
+        {
+            int pending = 0;
+            for (int i = 0; i < num_async_ops; i++) pending += slots[i].inflight;
+            if (pending == 0) break;
+            if (uring_submit_and_wait(&ring, 1) == -1) break;
+            unsigned head = *ring.cq_head;
+            unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++)
+            {
+                slots[ring.cqes[head & *ring.cq_mask].user_data >> 1].inflight--;
+                stats_depth(stats, -1);
+            }
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+        for (int i = 0; i < num_async_ops; i++)
+        {
+            if (slots[i].busy) feeder_done(feeder, &slots[i].block, -1);
+        }
+    }
+    hasher_stop(hashing);
+    free(slots);
+    free(order);
+    uring_teardown(&ring);
+    return status;
+}
+
@@ -0,0 +1,424 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include "acopy_internal.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC32C (Castagnoli) polynomial, bit-reflected.
+#define CRC32C_POLY 0x82f63b78
+// Buffers at least this long are hashed as three interleaved streams.
+#define CRC32C_STREAMS_MIN 768
+// Mismatching blocks reported one by one before the read-back only counts them.
+#define VERIFY_MAX_REPORTED 10
+
+// -------------------------------------------------------------------------------------------------------
+// CRC32C.
+// SSE4.2 has an instruction for it; elsewhere a slicing-by-8 table does 8 bytes per step. Block digests
+// are combined in offset order without reading the data again, so the digest of a whole file is the
+// plain CRC32C of its bytes, whatever the block size.
+// -------------------------------------------------------------------------------------------------------
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_x2n[32]; // x^(2^n) mod P, for combining.
+static int crc32c_hardware;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// a * b mod P.
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(8 * length) mod P: multiplying a CRC register by it appends length zero bytes.
+static uint32_t crc32c_zeros(size_t length)
+{
+    uint32_t p = 1u << 31; // x^0
+    for (unsigned k = 3; length; length >>= 1, k++)
+    {
+        if (length & 1) p = crc32c_multiply(crc32c_x2n[k & 31], p);
+    }
+    return p;
+}
+
+static void crc32c_init(void)
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (int n = 0; n < 256; n++)
+    {
+        for (int k = 1; k < 8; k++) crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][n] & 0xff];
+    }
+    uint32_t p = 1u << 30; // x^1
+    crc32c_x2n[0] = p;
+    for (int n = 1; n < 32; n++) crc32c_x2n[n] = p = crc32c_multiply(p, p);
+#if defined(__x86_64__)
+    crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *data, size_t length)
+{
+    while (length > 0 && ((uintptr_t)data & 7))
+    {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+        length--;
+    }
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc; // Little-endian: the low byte goes in first.
+        crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length)
+{
+    uint64_t crc64 = crc;
+    while (length > 0 && ((uintptr_t)data & 7))
+    {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+        length--;
+    }
+    if (length >= CRC32C_STREAMS_MIN)
+    {
+        // crc32 has a latency of three cycles but issues every cycle, so three independent streams over
+        // consecutive thirds run three times as fast. The thirds are joined by shifting the earlier ones.
+        size_t stripe = length / 24 * 8;
+        uint64_t crc1 = 0, crc2 = 0;
+        for (const unsigned char *end = data + stripe; data < end; data += 8)
+        {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, data, 8);
+            memcpy(&word1, data + stripe, 8);
+            memcpy(&word2, data + 2 * stripe, 8);
+            crc64 = _mm_crc32_u64(crc64, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+        }
+        uint32_t shift = crc32c_zeros(stripe);
+        crc64 = crc32c_multiply(shift, crc32c_multiply(shift, (uint32_t)crc64) ^ (uint32_t)crc1) ^ (uint32_t)crc2;
+        data += 2 * stripe;
+        length -= 3 * stripe;
+    }
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+    return (uint32_t)crc64;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hardware) return ~crc32c_sse42(crc, data, length);
+#endif
+    return ~crc32c_software(crc, data, length);
+}
+
+// CRC32C of A followed by B, from the CRC32C of each and the length of B.
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t length_b)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_multiply(crc32c_zeros(length_b), crc_a) ^ crc_b;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Digest table of one copy.
+// -------------------------------------------------------------------------------------------------------
+int digest_table_init(struct digest_table *table, off_t size, size_t block_size)
+{
+    table->block_size = block_size;
+    table->count = (size + block_size - 1) / block_size + 1;
+    table->entries = calloc(table->count, sizeof(struct digest_entry));
+    if (!table->entries)
+    {
+        perror("calloc");
+        return -1;
+    }
+    return 0;
+}
+
+void digest_table_free(struct digest_table *table)
+{
+    free(table->entries);
+    memset(table, 0, sizeof(*table));
+}
+
+struct digest_entry *digest_table_entry(struct digest_table *table, off_t offset)
+{
+    if (offset % table->block_size != 0) return &table->entries[table->count - 1];
+    return &table->entries[offset / table->block_size];
+}
+
+// Digest of all copied blocks in offset order; blocks is set to how many there were.
+uint32_t digest_table_combine(const struct digest_table *table, long *blocks)
+{
+    uint32_t crc = 0;
+    *blocks = 0;
+    for (size_t i = 0; i < table->count; i++)
+    {
+        const struct digest_entry *entry = &table->entries[i];
+        if (entry->length == 0) continue;
+        crc = crc32c_combine(crc, entry->crc, entry->length);
+        (*blocks)++;
+    }
+    return crc;
+}
+
+// Manifest: one "offset length crc32c" line per block, and the digest of the whole copy at the end.
+int digest_table_write(const struct digest_table *table, const char *path, uint32_t digest)
+{
+    FILE *out = fopen(path, "w");
+    if (!out)
+    {
+        perror(path);
+        return -1;
+    }
+    fprintf(out, "# acopy manifest: crc32c per block, block size %zu\n# offset length crc32c\n", table->block_size);
+    for (size_t i = 0; i < table->count; i++)
+    {
+        const struct digest_entry *entry = &table->entries[i];
+        if (entry->length > 0) fprintf(out, "%lld %zu %08x\n", (long long)entry->offset, entry->length, (unsigned)entry->crc);
+    }
+    fprintf(out, "# crc32c %08x\n", (unsigned)digest);
+    if (fclose(out) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Hashing thread.
+// An engine loop hands over a block as soon as it is in the buffer and goes on submitting; the block's
+// slot is only reused once its hash is done. Every slot has at most one job queued, so the queue never
+// fills up.
+// -------------------------------------------------------------------------------------------------------
+static void *hasher_main(void *arg)
+{
+    struct block_hasher *hasher = arg;
+    pthread_mutex_lock(&hasher->lock);
+    for (;;)
+    {
+        while (hasher->count == 0 && !hasher->stop) pthread_cond_wait(&hasher->work, &hasher->lock);
+        if (hasher->count == 0) break; // Stopped, and everything queued is hashed.
+        struct hash_job *job = hasher->queue[hasher->head];
+        hasher->head = (hasher->head + 1) % HASHER_QUEUE;
+        hasher->count--;
+        pthread_mutex_unlock(&hasher->lock);
+
+        job->entry->crc = crc32c(0, job->data, job->entry->length);
+
+        pthread_mutex_lock(&hasher->lock);
+        job->pending = 0;
+        pthread_cond_broadcast(&hasher->finished);
+    }
+    pthread_mutex_unlock(&hasher->lock);
+    return NULL;
+}
+
+// The thread starts with every signal blocked, so it never takes the posix-aio completion signal.
+int hasher_start(struct block_hasher *hasher, struct digest_table *table)
+{
+    sigset_t all, old;
+    memset(hasher, 0, sizeof(*hasher));
+    hasher->table = table;
+    pthread_mutex_init(&hasher->lock, NULL);
+    pthread_cond_init(&hasher->work, NULL);
+    pthread_cond_init(&hasher->finished, NULL);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    errno = pthread_create(&hasher->thread, NULL, hasher_main, hasher);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (errno != 0)
+    {
+        perror("pthread_create");
+        pthread_mutex_destroy(&hasher->lock);
+        pthread_cond_destroy(&hasher->work);
+        pthread_cond_destroy(&hasher->finished);
+        return -1;
+    }
+    return 0;
+}
+
+// Hash everything still queued and join the thread.
+void hasher_stop(struct block_hasher *hasher)
+{
+    if (!hasher) return;
+    pthread_mutex_lock(&hasher->lock);
+    hasher->stop = 1;
+    pthread_cond_signal(&hasher->work);
+    pthread_mutex_unlock(&hasher->lock);
+    pthread_join(hasher->thread, NULL);
+    pthread_mutex_destroy(&hasher->lock);
+    pthread_cond_destroy(&hasher->work);
+    pthread_cond_destroy(&hasher->finished);
+}
+
+void hasher_push(struct block_hasher *hasher, struct hash_job *job, const char *data, struct digest_entry *entry)
+{
+    job->data = data;
+    job->entry = entry;
+    job->pending = 1;
+    pthread_mutex_lock(&hasher->lock);
+    hasher->queue[(hasher->head + hasher->count) % HASHER_QUEUE] = job;
+    hasher->count++;
+    pthread_cond_signal(&hasher->work);
+    pthread_mutex_unlock(&hasher->lock);
+}
+
+void hasher_push_block(struct block_hasher *hasher, struct hash_job *job, const char *data, const struct copy_block *block)
+{
+    if (!hasher || block->length == 0) return;
+    struct digest_entry *entry = digest_table_entry(hasher->table, block->offset);
+    entry->offset = block->offset;
+    entry->length = block->length;
+    hasher_push(hasher, job, data, entry);
+}
+
+void hasher_wait(struct block_hasher *hasher, struct hash_job *job)
+{
+    if (!hasher) return;
+    pthread_mutex_lock(&hasher->lock);
+    while (job->pending) pthread_cond_wait(&hasher->finished, &hasher->lock);
+    pthread_mutex_unlock(&hasher->lock);
+}
+
+// -------------------------------------------------------------------------------------------------------
+// Read-back pass.
+// The destination is flushed and dropped from the page cache, then read again block by block with the
+// layout of the digest table. Each block is hashed while the next one is read, in two halves of buffer.
+// -------------------------------------------------------------------------------------------------------
+static ssize_t read_block(int fd, char *buffer, size_t length, off_t offset)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t ret = pread(fd, buffer + done, length - done, offset + done);
+        if (ret == -1)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (ret == 0) break;
+        done += ret;
+    }
+    return done;
+}
+
+static void verify_compare(const struct digest_entry *expected, const struct digest_entry *check, long *mismatches)
+{
+    if (check->length == expected->length && check->crc == expected->crc) return;
+    if (*mismatches < VERIFY_MAX_REPORTED)
+    {
+        fprintf(stderr, "Block at %lld differs: crc32c %08x over %zu bytes, expected %08x over %zu bytes\n", (long long)expected->offset,
+                (unsigned)check->crc, check->length, (unsigned)expected->crc, expected->length);
+    }
+    (*mismatches)++;
+}
+
+int verify_readback(int destination_fd, const char *destination_path, const struct digest_table *table, char *buffer, long *mismatches)
+{
+    struct block_hasher hasher;
+    struct hash_job jobs[2];
+    struct digest_entry checks[2];
+    const struct digest_entry *expected[2] = {NULL, NULL};
+    int half = 0;
+    int status = 0;
+    int fd;
+
+    *mismatches = 0;
+    // Without this the read-back would only see the page cache the copy just filled.
+    if (fdatasync(destination_fd) == -1)
+    {
+        perror("fdatasync");
+        return -1;
+    }
+    fd = open(destination_path, O_RDONLY);
+    if (fd == -1)
+    {
+        perror("open destination for read-back");
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    if (hasher_start(&hasher, NULL) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    for (size_t i = 0; i < table->count; i++)
+    {
+        const struct digest_entry *entry = &table->entries[i];
+        char *data = buffer + half * table->block_size;
+        if (entry->length == 0) continue;
+        ssize_t length = read_block(fd, data, entry->length, entry->offset);
+        if (length == -1)
+        {
+            perror("read-back");
+            status = -1;
+            break;
+        }
+        checks[half].offset = entry->offset;
+        checks[half].length = length;
+        expected[half] = entry;
+        hasher_push(&hasher, &jobs[half], data, &checks[half]);
+        // While this block is hashed, settle the one before it and read the next into its half.
+        half ^= 1;
+        if (expected[half])
+        {
+            hasher_wait(&hasher, &jobs[half]);
+            verify_compare(expected[half], &checks[half], mismatches);
+            expected[half] = NULL;
+        }
+    }
+    hasher_stop(&hasher);
+    for (int i = 0; i < 2; i++)
+    {
+        if (expected[i]) verify_compare(expected[i], &checks[i], mismatches);
+    }
+    close(fd);
+    return status;
+}
@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "acopy_internal.h"
+
+// Most threads a copy splits into; a deep queue of operations means nothing to these engines.
+#define ZERO_COPY_MAX_THREADS 64
+// Source bytes the mmap engine maps at a time.
+#define MMAP_WINDOW_BYTES (16 * 1024 * 1024)
+
+// -------------------------------------------------------------------------------------------------------
+// Zero-copy engines: the data never enters user space.
+// The byte range is split into num_async_ops contiguous parts (64 at most), and a thread copies each part
+// in chunks of block_size with copy_file_range, sendfile or splice.
+// The mmap engine splits the range the same way, but reads through a mapping of the page cache instead:
+// each thread maps windows of its part and writes the chunks out of them, or with mmap_copy, maps the
+// destination as well and copies between the two mappings.
+// -------------------------------------------------------------------------------------------------------
+struct range_worker
+{
+    pthread_t thread;
+    enum acopy_engine engine;
+    int source_fd, destination_fd;
+    off_t start, end;   // Range of the file this worker copies.
+    size_t chunk_size;  // Bytes moved per syscall.
+    int stream;         // mmap engine: copy into a mapped destination rather than pwrite() from the source mapping.
+    int error;          // errno of the first failure, 0 on success.
+    struct acopy_stats *stats;
+    struct acopy_throttle *throttle;
+    struct writeback writeback;
+    struct prefetch prefetch;
+};
+
+// Each syscall counts as one operation in flight; copies are recorded as writes, splice into the pipe as a read.
+static uint64_t zero_copy_begin(struct range_worker *worker)
+{
+    stats_depth(worker->stats, 1);
+    return stats_clock(worker->stats);
+}
+
+static void zero_copy_end(struct range_worker *worker, int write, uint64_t started_ns, ssize_t bytes)
+{
+    stats_latency(worker->stats, write, started_ns);
+    stats_depth(worker->stats, -1);
+    if (write && bytes > 0) stats_bytes(worker->stats, bytes);
+}
+
+// Each chunk counts as one operation against the throttle.
+static void zero_copy_throttle(struct range_worker *worker, size_t size)
+{
+    throttle_ready(worker->throttle, worker->stats, 1);
+    throttle_charge(worker->throttle, size);
+}
+
+static int range_copy_file_range(struct range_worker *worker)
+{
+    off_t offset_in = worker->start, offset_out = worker->start;
+    while (offset_in < worker->end)
+    {
+        size_t size = (worker->end - offset_in < (off_t)worker->chunk_size) ? (size_t)(worker->end - offset_in) : worker->chunk_size;
+        prefetch_advance(&worker->prefetch, offset_in);
+        zero_copy_throttle(worker, size);
+        uint64_t started = zero_copy_begin(worker);
+        ssize_t ret = copy_file_range(worker->source_fd, &offset_in, worker->destination_fd, &offset_out, size, 0);
+        zero_copy_end(worker, 1, started, ret);
+        if (ret == -1)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (ret == 0) break; // The source shrank.
+        writeback_advance(&worker->writeback, offset_out);
+    }
+    return 0;
+}
+
+static int range_sendfile(struct range_worker *worker)
+{
+    // sendfile writes at the file position of the destination, so every worker needs its own open file.
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", worker->destination_fd);
+    int out_fd = open(path, O_WRONLY);
+    if (out_fd == -1) return -1;
+    if (lseek(out_fd, worker->start, SEEK_SET) == -1)
+    {
+        close(out_fd);
+        return -1;
+    }
+
+    off_t offset = worker->start;
+    int status = 0;
+    while (offset < worker->end)
+    {
+        size_t size = (worker->end - offset < (off_t)worker->chunk_size) ? (size_t)(worker->end - offset) : worker->chunk_size;
+        prefetch_advance(&worker->prefetch, offset);
+        zero_copy_throttle(worker, size);
+        uint64_t started = zero_copy_begin(worker);
+        ssize_t ret = sendfile(out_fd, worker->source_fd, &offset, size);
+        zero_copy_end(worker, 1, started, ret);
+        if (ret == -1)
+        {
+            if (errno == EINTR) continue;
+            status = -1;
+            break;
+        }
+        if (ret == 0) break; // The source shrank.
+        writeback_advance(&worker->writeback, offset);
+    }
+    int saved_errno = errno;
+    close(out_fd);
+    errno = saved_errno;
+    return status;
+}
+
+static int range_splice(struct range_worker *worker)
+{
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) return -1;
+    // A pipe as large as a chunk moves each chunk with one splice in and one splice out.
+    int pipe_size = fcntl(pipe_fds[1], F_SETPIPE_SZ, (int)worker->chunk_size);
+    if (pipe_size == -1) pipe_size = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+
+    off_t offset_in = worker->start, offset_out = worker->start;
+    int status = 0;
+    while (offset_in < worker->end && status == 0)
+    {
+        size_t size = (worker->end - offset_in < (off_t)pipe_size) ? (size_t)(worker->end - offset_in) : (size_t)pipe_size;
+        prefetch_advance(&worker->prefetch, offset_in);
+        zero_copy_throttle(worker, size);
+        uint64_t started = zero_copy_begin(worker);
+        ssize_t in = splice(worker->source_fd, &offset_in, pipe_fds[1], NULL, size, SPLICE_F_MOVE);
+        zero_copy_end(worker, 0, started, in);
+        if (in == -1)
+        {
+            if (errno == EINTR) continue;
+            status = -1;
+            break;
+        }
+        if (in == 0) break; // The source shrank.
+        while (in > 0)
+        {
+            started = zero_copy_begin(worker);
+            ssize_t out = splice(pipe_fds[0], NULL, worker->destination_fd, &offset_out, in, SPLICE_F_MOVE);
+            zero_copy_end(worker, 1, started, out);
+            if (out == -1)
+            {
+                if (errno == EINTR) continue;
+                status = -1;
+                break;
+            }
+            in -= out;
+        }
+        writeback_advance(&worker->writeback, offset_out);
+    }
+    int saved_errno = errno;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    errno = saved_errno;
+    return status;
+}
+
+// Copy into the destination mapping with non-temporal stores. They go around the cache, so a large copy
+// does not push out everything else for data nobody reads again.
+static void stream_copy(char *destination, const char *source, size_t size)
+{
+#ifdef __SSE2__
+    // Plain copies up to the first 16-byte boundary of the destination and after the last one.
+    size_t head = (16 - (uintptr_t)destination % 16) % 16;
+    if (head > size) head = size;
+    memcpy(destination, source, head);
+    size_t i = head;
+    for (; i + 64 <= size; i += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(source + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(source + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(source + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(source + i + 48));
+        _mm_stream_si128((__m128i *)(destination + i), a);
+        _mm_stream_si128((__m128i *)(destination + i + 16), b);
+        _mm_stream_si128((__m128i *)(destination + i + 32), c);
+        _mm_stream_si128((__m128i *)(destination + i + 48), d);
+    }
+    for (; i + 16 <= size; i += 16)
+    {
+        _mm_stream_si128((__m128i *)(destination + i), _mm_loadu_si128((const __m128i *)(source + i)));
+    }
+    memcpy(destination + i, source + i, size - i);
+    // Streaming stores are weakly ordered: make them visible before the pages are written back.
+    _mm_sfence();
+#else
+    memcpy(destination, source, size);
+#endif
+}
+
+// The source is mapped a window at a time, populated up front and read sequentially. prepare_destination()
+// gives the destination its full size, preallocated or not, so its windows can be mapped too. A source that
+// shrinks under the mapping raises SIGBUS.
+static int range_mmap(struct range_worker *worker)
+{
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t window = ((off_t)worker->chunk_size > MMAP_WINDOW_BYTES) ? (off_t)worker->chunk_size : MMAP_WINDOW_BYTES;
+    off_t offset = worker->start;
+    int status = 0;
+    while (offset < worker->end && status == 0)
+    {
+        // Mappings start on a page; the block size need not be a multiple of one.
+        off_t map_start = offset - offset % page;
+        off_t map_end = (worker->end - map_start < window) ? worker->end : map_start + window;
+        size_t length = map_end - map_start;
+        char *destination = NULL;
+        char *source = mmap(NULL, length, PROT_READ, MAP_SHARED | MAP_POPULATE, worker->source_fd, map_start);
+        if (source == MAP_FAILED) return -1;
+        madvise(source, length, MADV_SEQUENTIAL);
+        if (worker->stream)
+        {
+            destination = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, worker->destination_fd, map_start);
+            if (destination == MAP_FAILED)
+            {
+                int saved_errno = errno;
+                munmap(source, length);
+                errno = saved_errno;
+                return -1;
+            }
+        }
+        while (offset < map_end)
+        {
+            size_t size = (map_end - offset < (off_t)worker->chunk_size) ? (size_t)(map_end - offset) : worker->chunk_size;
+            prefetch_advance(&worker->prefetch, offset);
+            zero_copy_throttle(worker, size);
+            uint64_t started = zero_copy_begin(worker);
+            ssize_t ret = (ssize_t)size;
+            if (destination) stream_copy(destination + (offset - map_start), source + (offset - map_start), size);
+            else ret = pwrite(worker->destination_fd, source + (offset - map_start), size, offset);
+            zero_copy_end(worker, 1, started, ret);
+            if (ret == -1)
+            {
+                if (errno == EINTR) continue;
+                status = -1;
+                break;
+            }
+            offset += ret;
+            writeback_advance(&worker->writeback, offset);
+        }
+        int saved_errno = errno;
+        munmap(source, length);
+        if (destination) munmap(destination, length);
+        errno = saved_errno;
+    }
+    return status;
+}
+
+static void *range_worker_main(void *arg)
+{
+    struct range_worker *worker = arg;
+    int ret;
+    if (worker->engine == ACOPY_ENGINE_COPY_FILE_RANGE) ret = range_copy_file_range(worker);
+    else if (worker->engine == ACOPY_ENGINE_SENDFILE) ret = range_sendfile(worker);
+    else if (worker->engine == ACOPY_ENGINE_SPLICE) ret = range_splice(worker);
+    else ret = range_mmap(worker);
+    worker->error = (ret == -1) ? errno : 0;
+    return NULL;
+}
+
+// Returns -1 with errno set to the first worker's error.
+int copy_zero_copy(enum acopy_engine engine, int source_fd, int destination_fd, off_t start, off_t end, const struct acopy_opts *opts)
+{
+    size_t block_size = opts->block_size;
+    // In HDD mode one thread walks the whole range, so the disk sees one stream.
+    int num_async_ops = (opts->hdd == ACOPY_HDD_ON) ? 1 : opts->num_async_ops;
+    if (num_async_ops > ZERO_COPY_MAX_THREADS) num_async_ops = ZERO_COPY_MAX_THREADS;
+    struct range_worker workers[ZERO_COPY_MAX_THREADS];
+    // Ranges are whole chunks, so only the last one can end in a partial chunk.
+    off_t chunks = (end - start + block_size - 1) / block_size;
+    off_t chunks_per_worker = (chunks + num_async_ops - 1) / num_async_ops;
+    int started = 0;
+    int error = 0;
+
+    for (int i = 0; i < num_async_ops; i++)
+    {
+        struct range_worker *worker = &workers[i];
+        worker->engine = engine;
+        worker->source_fd = source_fd;
+        worker->destination_fd = destination_fd;
+        worker->chunk_size = block_size;
+        worker->stream = opts->mmap_copy;
+        worker->stats = opts->stats;
+        worker->throttle = opts->throttle;
+        worker->start = start + i * chunks_per_worker * (off_t)block_size;
+        writeback_init(&worker->writeback, source_fd, destination_fd, worker->start, opts);
+        prefetch_init(&worker->prefetch, source_fd, worker->start, opts);
+        worker->end = worker->start + chunks_per_worker * (off_t)block_size;
+        worker->error = 0;
+        if (worker->start >= end) break;
+        if (worker->end > end) worker->end = end;
+        errno = pthread_create(&worker->thread, NULL, range_worker_main, worker);
+        if (errno != 0)
+        {
+            error = errno;
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        if (error == 0) error = workers[i].error;
+    }
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+// Errors meaning "this engine cannot copy between these files", so auto mode tries the next one.
+int zero_copy_unsupported(int error)
+{
+    return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP || error == EBADF;
+}
+
@@ -1,163 +1,505 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
-#include <string.h>
-#include <aio.h>
+#include <getopt.h>
+#include <math.h>
 #include <time.h>
+#include "acopy.h"
 
-#define MAX_IO_OPERATIONS 64
-struct aiocb aiocb_list[MAX_IO_OPERATIONS];
+// Upper bounds for the sweep grid.
+#define MAX_GRID 32
+#define MAX_VARIANTS 32
+#define MAX_REPETITIONS 1000
 
 // -------------------------------------------------------------------------------------------------------
-// Function to set up an asynchronous read operation.
+// Benchmark suite: copies the same file over a grid of block sizes and operation counts with the acopy
+// library, the exact code the async_copy executables run. Every cell is repeated and reported as
+// median, p95 and standard deviation, once per engine (and per completion strategy for posix-aio).
+// At the end it names the fastest variant for every block size, which shows where one engine overtakes
+// another, e.g. where mapping the source stops paying off against a queue of reads and writes.
 // -------------------------------------------------------------------------------------------------------
-void aio_read_setup(struct aiocb *aiocbp, int fd, off_t offset, volatile void *buf, size_t size)
+
+// One column of the results: an engine, with a completion strategy when the engine is posix-aio, and
+// with or without a mapped destination when it is mmap.
+struct variant
+{
+    enum acopy_engine engine;
+    enum acopy_completion completion;
+    int mmap_copy;
+    char name[48];
+};
+
+struct stats
 {
-    memset(aiocbp, 0, sizeof(struct aiocb)); // Clear out the aiocb structure to zero.
-    aiocbp->aio_fildes = fd;                 // File descriptor for the file to read from.
-    aiocbp->aio_buf = buf;                   // Buffer to read the data into.
-    aiocbp->aio_nbytes = size;               // Number of bytes to read.
-    aiocbp->aio_offset = offset;             // Offset in the file to start reading from.
-    if (aio_read(aiocbp) == -1)              // Initiate the read operation.
+    double median, p95, mean, stddev, min, max;
+};
+
+enum cache_mode
+{
+    CACHE_COLD, // drop source and destination from the page cache before every run
+    CACHE_WARM  // one untimed run first, then the source stays cached
+};
+
+static const struct option long_options[] =
+{
+    {"block-sizes", required_argument, NULL, 'b'},
+    {"ops",         required_argument, NULL, 'n'},
+    {"engines",     required_argument, NULL, 'e'},
+    {"completions", required_argument, NULL, 'c'},
+    {"repetitions", required_argument, NULL, 'r'},
+    {"cache",       required_argument, NULL, 'C'},
+    {"no-fsync",    no_argument,       NULL, 'F'},
+    {"direct",      no_argument,       NULL, 'd'},
+    {"hdd",         required_argument, NULL, 'H'},
+    {"huge-pages",  no_argument,       NULL, 'P'},
+    {"aio-threads", required_argument, NULL, 'A'},
+    {"generate",    required_argument, NULL, 'g'},
+    {"seed",        required_argument, NULL, 's'},
+    {"output",      required_argument, NULL, 'o'},
+    {"help",        no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+static void usage(FILE *out, const char *program)
+{
+    fprintf(out,
+            "Usage: %s [OPTION]... SOURCE DESTINATION\n"
+            "\n"
+            "  -b, --block-sizes=LIST   block sizes in KB (default 4,8,16,32,48,64,128)\n"
+            "  -n, --ops=LIST           operations in flight (default 1,2,4,8,12,16)\n"
+            "  -e, --engines=LIST       engines to compare (default posix-aio); mmap runs both with pwrite\n"
+            "                           (mmap/write) and into a mapped destination (mmap/copy)\n"
+            "  -c, --completions=LIST   completion strategies for posix-aio (default spin)\n"
+            "  -r, --repetitions=N      runs per cell (default 5)\n"
+            "      --cache=cold|warm    drop the page cache before every run, or warm it once (default cold)\n"
+            "      --no-fsync           stop the clock before the destination is flushed\n"
+            "  -d, --direct             copy with O_DIRECT\n"
+            "      --hdd=auto|on|off    HDD mode of the copies (default auto: on for rotational devices)\n"
+            "      --huge-pages         allocate the buffer pool from huge pages\n"
+            "      --aio-threads=N      glibc AIO helper threads (default: the largest operation count, 20-1024)\n"
+            "  -g, --generate=MB        first write a reproducible SOURCE of this size\n"
+            "  -s, --seed=N             seed for --generate (default 1)\n"
+            "  -o, --output=PREFIX      write PREFIX.csv and PREFIX.json (default execution_times)\n",
+            program);
+}
+
+// Split a comma-separated list of positive numbers.
+static int parse_numbers(const char *arg, long *values, int max)
+{
+    int count = 0;
+    char *end;
+    while (*arg)
     {
-        perror("aio_read");
-        exit(EXIT_FAILURE);
+        if (count == max) return -1;
+        values[count] = strtol(arg, &end, 10);
+        if (end == arg || values[count] < 1 || (*end != ',' && *end != '\0')) return -1;
+        count++;
+        arg = (*end == ',') ? end + 1 : end;
     }
+    return count;
 }
 
-// -------------------------------------------------------------------------------------------------------
-// Function to set up an asynchronous write operation.
-// -------------------------------------------------------------------------------------------------------
-void aio_write_setup(struct aiocb *aiocbp, int fd, off_t offset, volatile void *buf, size_t size)
+// Split a comma-separated list of names into a scratch copy.
+static int split_names(char *arg, char **names, int max)
 {
-    memset(aiocbp, 0, sizeof(struct aiocb)); // Clear out the aiocb structure to zero.
-    aiocbp->aio_fildes = fd;                 // File descriptor for the file to write to.
-    aiocbp->aio_buf = buf;                   // Buffer with the data to write.
-    aiocbp->aio_nbytes = size;               // Number of bytes to write.
-    aiocbp->aio_offset = offset;             // Offset in the file to start writing to.
-    if (aio_write(aiocbp) == -1)             // Initiate the write operation.
+    int count = 0;
+    for (char *name = strtok(arg, ","); name; name = strtok(NULL, ","))
     {
-        perror("aio_write");
-        exit(EXIT_FAILURE);
+        if (count == max) return -1;
+        names[count++] = name;
     }
+    return count;
 }
 
 // -------------------------------------------------------------------------------------------------------
-// Function to wait for all asynchronous I/O operations to complete.
+// Reproducible source file: xorshift64* output, so the same size and seed always give the same bytes.
 // -------------------------------------------------------------------------------------------------------
-void wait_for_aio_operations(struct aiocb *aiocbp_list, int num_ops) 
+static int generate_file(const char *path, long size_mb, uint64_t seed)
 {
-    for (int i = 0; i < num_ops; i++) {
-        while (aio_error(&aiocbp_list[i]) == EINPROGRESS) 
+    uint64_t state = seed ? seed : 1;
+    uint64_t block[8192];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror("open generated file");
+        return -1;
+    }
+    for (long written = 0; written < size_mb * 1024 * 1024; written += sizeof(block))
+    {
+        for (size_t i = 0; i < sizeof(block) / sizeof(block[0]); i++)
         {
-            usleep(1);
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            block[i] = state * 0x2545F4914F6CDD1DULL;
         }
-        int ret = aio_return(&aiocbp_list[i]);
-        if (ret == -1) 
+        if (write(fd, block, sizeof(block)) != (ssize_t)sizeof(block))
         {
-            perror("aio_return");
-            exit(EXIT_FAILURE);
+            perror("write generated file");
+            close(fd);
+            return -1;
         }
     }
+    if (fsync(fd) == -1) perror("fsync generated file");
+    close(fd);
+    return 0;
 }
 
-// -------------------------------------------------------------------------------------------------------
-// MAIN Function
-// -------------------------------------------------------------------------------------------------------
-int main() 
+// Start a run with nothing cached: fadvise always works on our own files, drop_caches only as root.
+static void drop_caches(const char *source_path, const char *destination_path)
 {
-    char source_path[256];
-    char destination_path[256];
-    size_t block_sizes[] = {4096, 4096*2, 4096*4, 4096*8, 4096*12, 4096*16, 4096*32};
-    int operations[] = {1, 2, 4, 8, 12, 16};
-    double execution_times[6][7]; 
-
-    printf("Enter the source file path: ");
-    scanf("%255s", source_path);
+    sync();
+    acopy_drop_cache(source_path);
+    acopy_drop_cache(destination_path);
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd == -1) return;
+    ssize_t ret = write(fd, "1", 1); // Fails without CAP_SYS_ADMIN; fadvise has already done what it can.
+    (void)ret;
+    close(fd);
+}
 
-    printf("Enter the destination file path: ");
-    scanf("%255s", destination_path);
+// One timed copy into a fresh destination, flushed to the device before the clock stops unless asked not to.
+static int timed_copy(struct acopy_ctx *ctx, const char *source_path, const char *destination_path, const struct acopy_opts *opts,
+                      int fsync_inclusive, double *elapsed)
+{
+    struct acopy_report report;
+    struct timespec start, finish;
 
-    FILE *file = fopen("execution_times.csv", "w");
-    if (file == NULL) 
+    if (unlink(destination_path) == -1 && errno != ENOENT)
     {
-        perror("fopen");
-        exit(EXIT_FAILURE);
+        perror("unlink destination");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (acopy_file(ctx, source_path, destination_path, opts, &report) == -1) return -1;
+    if (fsync_inclusive)
+    {
+        int fd = open(destination_path, O_WRONLY);
+        if (fd == -1 || fdatasync(fd) == -1)
+        {
+            perror("fdatasync destination");
+            if (fd != -1) close(fd);
+            return -1;
+        }
+        close(fd);
     }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    *elapsed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static struct stats compute_stats(const double *samples, int count)
+{
+    double sorted[MAX_REPETITIONS];
+    struct stats stats;
+    double sum = 0, squares = 0;
 
-    fprintf(file, "BlockSize(KB), 1 Op, 2 Ops, 4 Ops, 8 Ops, 12 Ops, 16 Ops\n");
+    memcpy(sorted, samples, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), compare_doubles);
+    for (int i = 0; i < count; i++) sum += sorted[i];
+    stats.mean = sum / count;
+    for (int i = 0; i < count; i++) squares += (sorted[i] - stats.mean) * (sorted[i] - stats.mean);
+    stats.stddev = count > 1 ? sqrt(squares / (count - 1)) : 0.0;
+    stats.median = (count % 2) ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+    stats.p95 = sorted[(int)ceil(0.95 * count) - 1]; // nearest rank
+    stats.min = sorted[0];
+    stats.max = sorted[count - 1];
+    return stats;
+}
+
+int main(int argc, char *argv[])
+{
+    long block_sizes[MAX_GRID] = {4, 8, 16, 32, 48, 64, 128};
+    long operations[MAX_GRID] = {1, 2, 4, 8, 12, 16};
+    int num_block_sizes = 7, num_operations = 6;
+    char engine_list[256] = "posix-aio", completion_list[256] = "spin";
+    char *engine_names[MAX_VARIANTS], *completion_names[MAX_VARIANTS];
+    struct variant variants[MAX_VARIANTS];
+    int num_variants = 0;
+    double fastest[MAX_GRID][MAX_VARIANTS]; // Best median of each variant over the operation counts.
+    int repetitions = 5;
+    enum cache_mode cache = CACHE_COLD;
+    int fsync_inclusive = 1;
+    int direct = 0;
+    enum acopy_hdd hdd = ACOPY_HDD_AUTO;
+    int huge_pages = 0;
+    int aio_threads = 0;
+    long generate_mb = 0;
+    uint64_t seed = 1;
+    const char *output = "execution_times";
+    char path[4096];
+    int opt;
 
-    for (int bs_index = 0; bs_index < 7; bs_index++) 
+    // Parse command line options.
+    // -------------------------------------------------------------------------------------------------------
+    while ((opt = getopt_long(argc, argv, "b:n:e:c:r:dg:s:o:h", long_options, NULL)) != -1)
     {
-        size_t block_size = block_sizes[bs_index];
-        fprintf(file, "%lu", block_size / 1024); 
+        switch (opt)
+        {
+        case 'b':
+            num_block_sizes = parse_numbers(optarg, block_sizes, MAX_GRID);
+            if (num_block_sizes == -1)
+            {
+                fprintf(stderr, "Invalid block size list: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            num_operations = parse_numbers(optarg, operations, MAX_GRID);
+            if (num_operations == -1)
+            {
+                fprintf(stderr, "Invalid operation count list: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            snprintf(engine_list, sizeof(engine_list), "%s", optarg);
+            break;
+        case 'c':
+            snprintf(completion_list, sizeof(completion_list), "%s", optarg);
+            break;
+        case 'r':
+            repetitions = atoi(optarg);
+            if (repetitions < 1 || repetitions > MAX_REPETITIONS)
+            {
+                fprintf(stderr, "The number of repetitions must be between 1 and %d\n", MAX_REPETITIONS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C':
+            if (strcmp(optarg, "cold") == 0) cache = CACHE_COLD;
+            else if (strcmp(optarg, "warm") == 0) cache = CACHE_WARM;
+            else
+            {
+                fprintf(stderr, "Unknown cache mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            fsync_inclusive = 0;
+            break;
+        case 'd':
+            direct = 1;
+            break;
+        case 'H':
+            if (strcmp(optarg, "auto") == 0) hdd = ACOPY_HDD_AUTO;
+            else if (strcmp(optarg, "on") == 0) hdd = ACOPY_HDD_ON;
+            else if (strcmp(optarg, "off") == 0) hdd = ACOPY_HDD_OFF;
+            else
+            {
+                fprintf(stderr, "Unknown HDD mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            huge_pages = 1;
+            break;
+        case 'A':
+            aio_threads = atoi(optarg);
+            if (aio_threads < 1 || aio_threads > ACOPY_MAX_IO_OPERATIONS)
+            {
+                fprintf(stderr, "The number of AIO threads must be between 1 and %d\n", ACOPY_MAX_IO_OPERATIONS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'g':
+            generate_mb = atol(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return 0;
+        default:
+            usage(stderr, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        usage(stderr, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    const char *source_path = argv[optind];
+    const char *destination_path = argv[optind + 1];
 
-        for (int op_index = 0; op_index < 6; op_index++) 
+    // Every engine is one column; posix-aio gets one column per completion strategy, mmap one per way of writing.
+    int num_engines = split_names(engine_list, engine_names, MAX_VARIANTS);
+    int num_completions = split_names(completion_list, completion_names, MAX_VARIANTS);
+    if (num_engines < 1 || num_completions < 1)
+    {
+        fprintf(stderr, "At most %d engines and %d completion strategies can be compared\n", MAX_VARIANTS, MAX_VARIANTS);
+        exit(EXIT_FAILURE);
+    }
+    for (int e = 0; e < num_engines; e++)
+    {
+        enum acopy_engine engine;
+        if (acopy_engine_parse(engine_names[e], &engine) == -1)
+        {
+            fprintf(stderr, "Unknown engine: %s\n", engine_names[e]);
+            exit(EXIT_FAILURE);
+        }
+        int columns = (engine == ACOPY_ENGINE_POSIX_AIO) ? num_completions : (engine == ACOPY_ENGINE_MMAP) ? 2 : 1;
+        for (int c = 0; c < columns; c++)
         {
-            int num_async_ops = operations[op_index];
-            int source_fd = open(source_path, O_RDONLY);
-            int destination_fd = open(destination_path, O_WRONLY | O_CREAT, 0644);
-            char *buffer = (char *)malloc(block_size * num_async_ops);
-            if (!buffer) 
+            if (num_variants == MAX_VARIANTS) break;
+            struct variant *variant = &variants[num_variants];
+            variant->engine = engine;
+            variant->completion = ACOPY_COMPLETION_SPIN;
+            variant->mmap_copy = (engine == ACOPY_ENGINE_MMAP && c == 1);
+            if (engine == ACOPY_ENGINE_POSIX_AIO && acopy_completion_parse(completion_names[c], &variant->completion) == -1)
             {
-                perror("malloc");
+                fprintf(stderr, "Unknown completion mode: %s\n", completion_names[c]);
                 exit(EXIT_FAILURE);
             }
+            if (engine == ACOPY_ENGINE_POSIX_AIO) snprintf(variant->name, sizeof(variant->name), "%s/%s", engine_names[e], completion_names[c]);
+            else if (engine == ACOPY_ENGINE_MMAP) snprintf(variant->name, sizeof(variant->name), "%s/%s", engine_names[e], c ? "copy" : "write");
+            else snprintf(variant->name, sizeof(variant->name), "%s", engine_names[e]);
+            num_variants++;
+        }
+    }
 
-            off_t offset = 0;
-            struct timespec start, finish;
-            double elapsed;
+    // glibc fixes its AIO pool at the first copy, which is the one with the fewest operations: size it to
+    // the deepest cell instead, so every cell runs on the same pool.
+    if (aio_threads == 0)
+    {
+        for (int i = 0; i < num_operations; i++)
+        {
+            if (operations[i] > aio_threads) aio_threads = operations[i] > 1024 ? 1024 : operations[i];
+        }
+        if (aio_threads < 20) aio_threads = 20;
+    }
 
-            clock_gettime(CLOCK_MONOTONIC, &start);
+    if (generate_mb > 0 && generate_file(source_path, generate_mb, seed) == -1) exit(EXIT_FAILURE);
 
-            for (int i = 0; i < num_async_ops; i++) 
-            {
-                aio_read_setup(&aiocb_list[i], source_fd, offset, buffer + (i * block_size), block_size);
-                offset += block_size;
-            }
-            
-            int ops_in_progress = num_async_ops;
-            while (ops_in_progress > 0) 
+    struct acopy_ctx *ctx = acopy_ctx_new();
+    if (!ctx) exit(EXIT_FAILURE);
+
+    snprintf(path, sizeof(path), "%s.csv", output);
+    FILE *csv = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s.json", output);
+    FILE *json = fopen(path, "w");
+    if (csv == NULL || json == NULL)
+    {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(csv, "BlockSize(KB),Ops");
+    for (int v = 0; v < num_variants; v++)
+    {
+        fprintf(csv, ",%s median,%s p95,%s stddev", variants[v].name, variants[v].name, variants[v].name);
+    }
+    fprintf(csv, "\n");
+    fprintf(json, "{\n  \"source\": \"%s\",\n  \"repetitions\": %d,\n  \"cache\": \"%s\",\n  \"fsync\": %s,\n  \"direct\": %s,\n  \"hdd\": \"%s\",\n  \"huge_pages\": %s,\n  \"aio_threads\": %d,\n  \"cells\": [",
+            source_path, repetitions, cache == CACHE_COLD ? "cold" : "warm", fsync_inclusive ? "true" : "false", direct ? "true" : "false",
+            hdd == ACOPY_HDD_AUTO ? "auto" : hdd == ACOPY_HDD_ON ? "on" : "off", huge_pages ? "true" : "false", aio_threads);
+
+    int first_cell = 1;
+    for (int bs_index = 0; bs_index < num_block_sizes; bs_index++)
+    {
+        for (int op_index = 0; op_index < num_operations; op_index++)
+        {
+            fprintf(csv, "%ld,%ld", block_sizes[bs_index], operations[op_index]);
+            for (int v = 0; v < num_variants; v++)
             {
-                wait_for_aio_operations(aiocb_list, num_async_ops);
-                for (int i = 0; i < num_async_ops; i++) 
+                struct acopy_opts opts;
+                double samples[MAX_REPETITIONS];
+                struct stats stats;
+
+                acopy_opts_init(&opts);
+                opts.engine = variants[v].engine;
+                opts.completion = variants[v].completion;
+                opts.block_size = block_sizes[bs_index] * 1024;
+                opts.num_async_ops = operations[op_index];
+                opts.direct = direct;
+                opts.hdd = hdd;
+                opts.mmap_copy = variants[v].mmap_copy;
+                opts.huge_pages = huge_pages;
+                opts.aio_threads = aio_threads;
+                if (acopy_opts_check(&opts) == -1) exit(EXIT_FAILURE);
+
+                if (cache == CACHE_WARM && timed_copy(ctx, source_path, destination_path, &opts, fsync_inclusive, &samples[0]) == -1)
                 {
-                    ssize_t bytes_read = aio_return(&aiocb_list[i]);
-                    if (bytes_read > 0) 
-                    {
-                        aio_write_setup(&aiocb_list[i], destination_fd, aiocb_list[i].aio_offset, (void *)aiocb_list[i].aio_buf, bytes_read);
-                    } 
-                    else 
-                    {
-                        ops_in_progress--;
-                    }
+                    exit(EXIT_FAILURE);
                 }
-                wait_for_aio_operations(aiocb_list, num_async_ops);
-                for (int i = 0; i < num_async_ops; i++) 
+                for (int r = 0; r < repetitions; r++)
                 {
-                    ssize_t bytes_written = aio_return(&aiocb_list[i]);
-                    if (bytes_written > 0) 
+                    if (cache == CACHE_COLD) drop_caches(source_path, destination_path);
+                    if (timed_copy(ctx, source_path, destination_path, &opts, fsync_inclusive, &samples[r]) == -1)
                     {
-                        aio_read_setup(&aiocb_list[i], source_fd, offset, buffer + (i * block_size), block_size);
-                        offset += block_size;
+                        fprintf(stderr, "Copying failed with %ld KB blocks, %ld operations, %s\n", block_sizes[bs_index], operations[op_index], variants[v].name);
+                        exit(EXIT_FAILURE);
                     }
                 }
+                stats = compute_stats(samples, repetitions);
+                if (op_index == 0 || stats.median < fastest[bs_index][v]) fastest[bs_index][v] = stats.median;
+                printf("%4ld KB %3ld ops %-20s median %f s  p95 %f s  stddev %f s\n", block_sizes[bs_index], operations[op_index],
+                       variants[v].name, stats.median, stats.p95, stats.stddev);
+
+                fprintf(csv, ",%f,%f,%f", stats.median, stats.p95, stats.stddev);
+                fprintf(json, "%s\n    {\"block_size_kb\": %ld, \"ops\": %ld, \"engine\": \"%s\", \"completion\": \"%s\", \"variant\": \"%s\",",
+                        first_cell ? "" : ",", block_sizes[bs_index], operations[op_index], acopy_engine_name(variants[v].engine),
+                        variants[v].engine == ACOPY_ENGINE_POSIX_AIO ? acopy_completion_name(variants[v].completion) : "", variants[v].name);
+                fprintf(json, " \"median\": %f, \"p95\": %f, \"mean\": %f, \"stddev\": %f, \"min\": %f, \"max\": %f, \"samples\": [",
+                        stats.median, stats.p95, stats.mean, stats.stddev, stats.min, stats.max);
+                for (int r = 0; r < repetitions; r++) fprintf(json, "%s%f", r ? ", " : "", samples[r]);
+                fprintf(json, "]}");
+                first_cell = 0;
+            }
+            fprintf(csv, "\n");
+            fflush(csv);
+        }
+    }
+    fprintf(json, "\n  ],\n  \"fastest\": [");
+
+    // The winner of every block size, and by how much it beats the runner-up.
+    // -------------------------------------------------------------------------------------------------------
+    printf("\nFastest variant per block size (best median over the operation counts):\n");
+    int previous = -1;
+    for (int bs_index = 0; bs_index < num_block_sizes; bs_index++)
+    {
+        int best = 0, second = -1;
+        for (int v = 1; v < num_variants; v++)
+        {
+            if (fastest[bs_index][v] < fastest[bs_index][best])
+            {
+                second = best;
+                best = v;
             }
-            clock_gettime(CLOCK_MONOTONIC, &finish);
-            elapsed = (finish.tv_sec - start.tv_sec);
-            elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
-            execution_times[op_index][bs_index] = elapsed;
-            fprintf(file, ", %f", elapsed); 
-            close(source_fd);
-            close(destination_fd);
-            free(buffer);
+            else if (second == -1 || fastest[bs_index][v] < fastest[bs_index][second]) second = v;
         }
-        fprintf(file, "\n"); 
+        printf("%4ld KB  %-20s %f s", block_sizes[bs_index], variants[best].name, fastest[bs_index][best]);
+        if (second != -1)
+        {
+            printf(", %.2fx ahead of %s", fastest[bs_index][best] > 0 ? fastest[bs_index][second] / fastest[bs_index][best] : 0.0,
+                   variants[second].name);
+        }
+        printf("%s\n", (previous != -1 && previous != best) ? "  <- crossover" : "");
+        fprintf(json, "%s\n    {\"block_size_kb\": %ld, \"variant\": \"%s\", \"median\": %f}", bs_index ? "," : "", block_sizes[bs_index],
+                variants[best].name, fastest[bs_index][best]);
+        previous = best;
     }
-    fclose(file);
-    printf("\nExecution times have been saved to 'execution_times.csv'\n");
+    fprintf(json, "\n  ]\n}\n");
+    fclose(csv);
+    fclose(json);
+    acopy_ctx_free(ctx);
+    printf("\nExecution times have been saved to '%s.csv' and '%s.json'\n", output, output);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,23 +1,68 @@
 # pip install pandas matplotlib
+#
+# python3 build_graphs.py [execution_times.csv]
+#
+# Benchmark CSVs have one row per (block size, ops) cell and a "median", "p95" and "stddev" column per
+# engine (posix-aio gets one per completion strategy). Older CSVs from the single-run harness, with one
+# column per number of operations, are still plotted as before.
+
+import sys
 
 import pandas as pd
 import matplotlib.pyplot as plt
 
+path = sys.argv[1] if len(sys.argv) > 1 else 'execution_times.csv'
+prefix = path[:-4] if path.endswith('.csv') else path
+
 # Reading the CSV file
-df = pd.read_csv('execution_times.csv')
+df = pd.read_csv(path, skipinitialspace=True)
 
-# Setting the block size as the index
-df.set_index('BlockSize(KB)', inplace=True)
+if 'Ops' not in df.columns:
+    # Single-run results: one line per number of operations, no error bars.
+    df.set_index('BlockSize(KB)', inplace=True)
+    plt.figure(figsize=(10, 6))
+    for column in df.columns:
+        plt.plot(df.index, df[column], label=column)
+    plt.xlabel('Block Size (KB)')
+    plt.ylabel('Execution Time (Seconds)')
+    plt.title('Execution Time vs Block Size for Different Operations')
+    plt.legend(title='Number of Operations')
+    plt.grid(True)
+    plt.savefig(prefix + '.png')
+    plt.show()
+    sys.exit(0)
 
-# Plotting
-plt.figure(figsize=(10, 6))
-for column in df.columns:
-    plt.plot(df.index, df[column], label=column)
+variants = [column[:-len(' median')] for column in df.columns if column.endswith(' median')]
 
+# One panel per engine: median time against block size, one line per number of operations,
+# with the standard deviation as error bars.
+fig, axes = plt.subplots(len(variants), 1, figsize=(10, 5 * len(variants)), squeeze=False)
+for ax, variant in zip(axes[:, 0], variants):
+    for ops, cells in df.groupby('Ops'):
+        ax.errorbar(cells['BlockSize(KB)'], cells[variant + ' median'], yerr=cells[variant + ' stddev'],
+                    label=str(ops), capsize=3, marker='o', markersize=3)
+    ax.set_xscale('log', base=2)
+    ax.set_xlabel('Block Size (KB)')
+    ax.set_ylabel('Median Execution Time (Seconds)')
+    ax.set_title(variant)
+    ax.legend(title='Number of Operations')
+    ax.grid(True)
+fig.tight_layout()
+fig.savefig(prefix + '.png')
+
+# Engine comparison: for every block size, each engine at its best number of operations,
+# with error bars from the standard deviation and the p95 as a dashed line.
+plt.figure(figsize=(10, 6))
+for variant in variants:
+    best = df.loc[df.groupby('BlockSize(KB)')[variant + ' median'].idxmin()]
+    line = plt.errorbar(best['BlockSize(KB)'], best[variant + ' median'], yerr=best[variant + ' stddev'],
+                        label=variant, capsize=3, marker='o', markersize=3)
+    plt.plot(best['BlockSize(KB)'], best[variant + ' p95'], linestyle='--', color=line[0].get_color(), alpha=0.5)
+plt.xscale('log', base=2)
 plt.xlabel('Block Size (KB)')
-plt.ylabel('Execution Time (Seconds)')
-plt.title('Execution Time vs Block Size for Different Operations')
-plt.legend(title='Number of Operations')
+plt.ylabel('Median Execution Time (Seconds), best number of operations')
+plt.title('Engine Comparison (dashed: p95)')
+plt.legend(title='Engine')
 plt.grid(True)
-plt.savefig('execution_times.png')
+plt.savefig(prefix + '_engines.png')
 plt.show()